@@ -0,0 +1,42 @@
+#include "AtomicFile.h"
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include <itksys/SystemTools.hxx>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+std::string AtomicFile::TemporaryName(const std::string &path) {
+    static std::atomic<unsigned long long> counter(0);
+#ifdef _WIN32
+    const long long process = _getpid();
+#else
+    const long long process = getpid();
+#endif
+    std::ostringstream name;
+    name << path << '.' << process << '.' << std::hash<std::thread::id>()(std::this_thread::get_id()) << '.' << counter++ << ".tmp";
+    return name.str();
+}
+
+bool AtomicFile::Commit(const std::string &temporary, const std::string &path) {
+#ifdef _WIN32
+    const bool moved = MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    const bool moved = std::rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+    if (moved) {
+        return true;
+    }
+
+    // Lost a race with another writer of the same file, or (on Windows)
+    // the existing file is open in a reader
+    std::remove(temporary.c_str());
+    return itksys::SystemTools::FileExists(path.c_str());
+}
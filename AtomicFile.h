@@ -0,0 +1,16 @@
+#pragma once
+#include <string>
+
+// Whole-file replacement for the on-disk caches and outputs: write to a
+// temporary name that no other writer uses, then rename it over the final
+// path, so readers see either the old file or the complete new one.
+class AtomicFile
+{
+public:
+    // Temporary name next to path, unique per process, thread and call
+    static std::string TemporaryName(const std::string &path);
+
+    // Move temporary over path. If another writer got there first the
+    // temporary is removed and the existing file counts as success.
+    static bool Commit(const std::string &temporary, const std::string &path);
+};
@@ -0,0 +1,76 @@
+#include "SparseChangeMap.h"
+#include "SparseChangeMap.cxx"
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+
+#define DIMENSION 3
+
+// Report a change map's geometry and how much of it was stored, and
+// optionally write it out densely
+template <typename TImage>
+void Report(const char *changeMapFile, const char *outputFile) {
+    typedef SparseChangeMap<TImage> ChangeMapType;
+    typedef itk::ImageFileWriter<TImage> WriterType;
+
+    typename ChangeMapType::Statistics statistics;
+    const unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+    typename TImage::Pointer image = ChangeMapType::Read(changeMapFile, threads, &statistics);
+
+    const typename TImage::SizeType &size = image->GetLargestPossibleRegion().GetSize();
+    std::cout << "Size: " << size[0] << " x " << size[1] << " x " << size[2] << std::endl;
+    std::cout << "Pixel: " << (sizeof(typename TImage::PixelType) == 2 ? "int16" : "float") << std::endl;
+    std::cout << "Spacing: " << image->GetSpacing() << std::endl;
+    std::cout << "Origin: " << image->GetOrigin() << std::endl;
+    std::cout << "Stored blocks: " << statistics.storedBlocks << " of " << statistics.totalBlocks << std::endl;
+    std::cout << "Compressed: " << statistics.compressedBytes / (1024.0 * 1024.0) << " MB of "
+              << statistics.denseBytes / (1024.0 * 1024.0) << " MB dense" << std::endl;
+
+    if (outputFile) {
+        typename WriterType::Pointer writer = WriterType::New();
+        writer->SetFileName(outputFile);
+        writer->SetInput(image);
+        writer->Update();
+    }
+}
+
+// Reads a sparse change map written with --sparse-output, float or int16,
+// reports its geometry and how much of it was stored, and optionally writes
+// it out densely in any format ITK can write.
+int main(int argc, char **argv) {
+    typedef itk::Image<float, DIMENSION> FloatImageType;
+    typedef itk::Image<short, DIMENSION> ShortImageType;
+
+    if (argc < 2) {
+        std::cout << "USAGE: " << std::endl;
+        std::cout << "ChangeMapTool.exe <Change Map> [<Output Image>]" << std::endl;
+        std::cout << "Change Map -- A file written by LungChangeDetector with --sparse-output." << std::endl;
+        std::cout << "Output Image -- Optional dense copy, e.g. change.mha or change.nrrd." << std::endl;
+        return 1;
+    }
+
+    try {
+        const char *outputFile = argc > 2 ? argv[2] : ITK_NULLPTR;
+        typedef SparseChangeMap<ShortImageType> ChangeMapType;
+        const ChangeMapType::PixelTypeCode pixelType = ChangeMapType::ReadPixelType(argv[1]);
+        if (pixelType == ChangeMapType::Int16) {
+            Report<ShortImageType>(argv[1], outputFile);
+        }
+        else if (pixelType == ChangeMapType::Float32) {
+            Report<FloatImageType>(argv[1], outputFile);
+        }
+        else {
+            std::cout << argv[1] << " is not an int16 or float change map" << std::endl;
+            return 1;
+        }
+    }
+    catch (itk::ExceptionObject &e) {
+        std::cout << e.GetDescription() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "DistanceMorphologyImageFilter.h"
+#include <cmath>
+
+template <typename TImage>
+DistanceMorphologyImageFilter<TImage>::DistanceMorphologyImageFilter()
+{
+    m_Operation = Close;
+    m_Radius = 3.0;
+    m_ForegroundValue = itk::NumericTraits<PixelType>::max();
+}
+
+template <typename TImage>
+DistanceMorphologyImageFilter<TImage>::~DistanceMorphologyImageFilter()
+{
+    //
+}
+
+template <typename TImage>
+void DistanceMorphologyImageFilter<TImage>::GenerateInputRequestedRegion() {
+    Superclass::GenerateInputRequestedRegion();
+    ImageType *input = const_cast<ImageType *>(this->GetInput());
+    if (input) {
+        input->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+template <typename TImage>
+void DistanceMorphologyImageFilter<TImage>::EnlargeOutputRequestedRegion(itk::DataObject *output) {
+    output->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <typename TImage>
+void DistanceMorphologyImageFilter<TImage>::GenerateData() {
+    typename ImageType::Pointer input = ImageType::New();
+    input->Graft(this->GetInput());
+
+    ImagePointer result;
+    switch (m_Operation) {
+    case Dilate:
+        result = DilateImage(input);
+        break;
+    case Erode:
+        result = ErodeImage(input);
+        break;
+    case Close:
+        result = ErodeImage(DilateImage(input));
+        break;
+    case Open:
+        result = DilateImage(ErodeImage(input));
+        break;
+    }
+    this->GraftOutput(result);
+}
+
+template <typename TImage>
+typename DistanceMorphologyImageFilter<TImage>::ImagePointer
+DistanceMorphologyImageFilter<TImage>::DilateImage(const ImageType *image) {
+    // Keep every voxel within the radius of the foreground
+    typename DistanceFilterType::Pointer distance = DistanceFilterType::New();
+    distance->SetNumberOfThreads(this->GetNumberOfThreads());
+    distance->SetInput(image);
+    distance->SetBackgroundValue(itk::NumericTraits<PixelType>::ZeroValue());
+    distance->SquaredDistanceOn();
+    distance->UseImageSpacingOff();
+    distance->InsideIsPositiveOff();
+
+    typename ThresholdFilterType::Pointer threshold = ThresholdFilterType::New();
+    threshold->SetNumberOfThreads(this->GetNumberOfThreads());
+    threshold->SetInput(distance->GetOutput());
+    threshold->SetLowerThreshold(itk::NumericTraits<float>::NonpositiveMin());
+    threshold->SetUpperThreshold(static_cast<float>(m_Radius * m_Radius));
+    threshold->SetInsideValue(m_ForegroundValue);
+    threshold->SetOutsideValue(itk::NumericTraits<PixelType>::ZeroValue());
+    threshold->Update();
+
+    ImagePointer result = threshold->GetOutput();
+    result->DisconnectPipeline();
+    return result;
+}
+
+template <typename TImage>
+typename DistanceMorphologyImageFilter<TImage>::ImagePointer
+DistanceMorphologyImageFilter<TImage>::ErodeImage(const ImageType *image) {
+    // Keep foreground voxels farther than the radius from any background
+    // voxel. The foreground is the distance map's background here, so its
+    // voxels get a positive distance to the nearest background voxel.
+    typename DistanceFilterType::Pointer distance = DistanceFilterType::New();
+    distance->SetNumberOfThreads(this->GetNumberOfThreads());
+    distance->SetInput(image);
+    distance->SetBackgroundValue(m_ForegroundValue);
+    distance->SquaredDistanceOn();
+    distance->UseImageSpacingOff();
+    distance->InsideIsPositiveOff();
+
+    // Squared voxel distances are integers
+    typename ThresholdFilterType::Pointer threshold = ThresholdFilterType::New();
+    threshold->SetNumberOfThreads(this->GetNumberOfThreads());
+    threshold->SetInput(distance->GetOutput());
+    threshold->SetLowerThreshold(static_cast<float>(std::floor(m_Radius * m_Radius) + 1.0));
+    threshold->SetUpperThreshold(itk::NumericTraits<float>::max());
+    threshold->SetInsideValue(m_ForegroundValue);
+    threshold->SetOutsideValue(itk::NumericTraits<PixelType>::ZeroValue());
+    threshold->Update();
+
+    ImagePointer result = threshold->GetOutput();
+    result->DisconnectPipeline();
+    return result;
+}
@@ -0,0 +1,86 @@
+#include "GaussianSmoothingImageFilter.h"
+#include <cmath>
+
+template <typename TInputImage, typename TOutputImage>
+GaussianSmoothingImageFilter<TInputImage, TOutputImage>::GaussianSmoothingImageFilter()
+{
+    discreteFilter = DiscreteFilterType::New();
+    recursiveFilter = RecursiveFilterType::New();
+    m_Variance = 1.0;
+    m_UseRecursive = false;
+}
+
+template <typename TInputImage, typename TOutputImage>
+GaussianSmoothingImageFilter<TInputImage, TOutputImage>::~GaussianSmoothingImageFilter()
+{
+    //
+}
+
+template <typename TInputImage, typename TOutputImage>
+typename GaussianSmoothingImageFilter<TInputImage, TOutputImage>::SizeType
+GaussianSmoothingImageFilter<TInputImage, TOutputImage>::KernelRadius(double variance, const SpacingType &spacing) {
+    // The same operators DiscreteGaussianImageFilter builds with its default
+    // maximum error and kernel width and image spacing on
+    SizeType radius;
+    for (unsigned int d = 0; d < ImageType::ImageDimension; d++) {
+        itk::GaussianOperator<double, ImageType::ImageDimension> gaussian;
+        gaussian.SetDirection(d);
+        gaussian.SetVariance(variance / (spacing[d] * spacing[d]));
+        gaussian.SetMaximumError(0.01);
+        gaussian.SetMaximumKernelWidth(32);
+        gaussian.CreateDirectional();
+        radius[d] = gaussian.GetRadius(d);
+    }
+    return radius;
+}
+
+template <typename TInputImage, typename TOutputImage>
+void GaussianSmoothingImageFilter<TInputImage, TOutputImage>::GenerateInputRequestedRegion() {
+    Superclass::GenerateInputRequestedRegion();
+    ImageType *input = const_cast<ImageType *>(this->GetInput());
+    if (!input) {
+        return;
+    }
+
+    // The recursive filter runs along whole rows; the discrete kernel only
+    // needs its radius around the output region
+    if (m_UseRecursive) {
+        input->SetRequestedRegionToLargestPossibleRegion();
+        return;
+    }
+    typename ImageType::RegionType region = this->GetOutput()->GetRequestedRegion();
+    region.PadByRadius(KernelRadius(m_Variance, input->GetSpacing()));
+    region.Crop(input->GetLargestPossibleRegion());
+    input->SetRequestedRegion(region);
+}
+
+template <typename TInputImage, typename TOutputImage>
+void GaussianSmoothingImageFilter<TInputImage, TOutputImage>::EnlargeOutputRequestedRegion(itk::DataObject *output) {
+    Superclass::EnlargeOutputRequestedRegion(output);
+    if (m_UseRecursive) {
+        output->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+template <typename TInputImage, typename TOutputImage>
+void GaussianSmoothingImageFilter<TInputImage, TOutputImage>::GenerateData() {
+    typename ImageType::Pointer input = ImageType::New();
+    input->Graft(this->GetInput());
+
+    if (m_UseRecursive) {
+        recursiveFilter->SetNumberOfThreads(this->GetNumberOfThreads());
+        recursiveFilter->SetInput(input);
+        recursiveFilter->SetSigma(std::sqrt(m_Variance));
+        recursiveFilter->GraftOutput(this->GetOutput());
+        recursiveFilter->Update();
+        this->GraftOutput(recursiveFilter->GetOutput());
+    }
+    else {
+        discreteFilter->SetNumberOfThreads(this->GetNumberOfThreads());
+        discreteFilter->SetInput(input);
+        discreteFilter->SetVariance(m_Variance);
+        discreteFilter->GraftOutput(this->GetOutput());
+        discreteFilter->Update();
+        this->GraftOutput(discreteFilter->GetOutput());
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <itkImage.h>
+#include <itkImageToImageFilter.h>
+#include <itkDiscreteGaussianImageFilter.h>
+#include <itkSmoothingRecursiveGaussianImageFilter.h>
+#include <itkGaussianOperator.h>
+
+// Gaussian smoothing by variance (in physical units) with a choice of
+// implementation. The discrete filter's kernel grows with the variance; the
+// recursive (IIR) filter costs the same per voxel for any variance. The
+// discrete filter streams, reading its output region plus the kernel radius;
+// the recursive one always reads and writes the whole image.
+template <typename TInputImage, typename TOutputImage>
+class GaussianSmoothingImageFilter : public itk::ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+    typedef GaussianSmoothingImageFilter<TInputImage, TOutputImage> Self;
+    typedef itk::ImageToImageFilter<TInputImage, TOutputImage> Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    typedef itk::SmartPointer<const Self> ConstPointer;
+    typedef TInputImage ImageType;
+    typedef typename ImageType::SizeType SizeType;
+    typedef typename ImageType::SpacingType SpacingType;
+
+    itkNewMacro(Self);
+    itkSetMacro(Variance, double);
+    itkGetMacro(Variance, double);
+    itkSetMacro(UseRecursive, bool);
+    itkGetMacro(UseRecursive, bool);
+    itkBooleanMacro(UseRecursive);
+
+    GaussianSmoothingImageFilter();
+    ~GaussianSmoothingImageFilter();
+
+    // Voxels the discrete kernel reaches along each axis for this variance and spacing
+    static SizeType KernelRadius(double variance, const SpacingType &spacing);
+
+protected:
+    typedef itk::DiscreteGaussianImageFilter<TInputImage, TOutputImage> DiscreteFilterType;
+    typedef typename DiscreteFilterType::Pointer DiscreteFilterTypePointer;
+    typedef itk::SmoothingRecursiveGaussianImageFilter<TInputImage, TOutputImage> RecursiveFilterType;
+    typedef typename RecursiveFilterType::Pointer RecursiveFilterTypePointer;
+
+    void GenerateInputRequestedRegion();
+    void EnlargeOutputRequestedRegion(itk::DataObject *output);
+    void GenerateData();
+
+private:
+    DiscreteFilterTypePointer discreteFilter;
+    RecursiveFilterTypePointer recursiveFilter;
+    double m_Variance;
+    bool m_UseRecursive;
+};
@@ -0,0 +1,190 @@
+#include "IntensityMatching.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+template <typename TImage>
+typename IntensityMatching<TImage>::ImagePointer IntensityMatching<TImage>::AllocateLike(const ImageType *image) {
+    ImagePointer output = ImageType::New();
+    output->CopyInformation(image);
+    output->SetRegions(image->GetBufferedRegion());
+    output->Allocate();
+    return output;
+}
+
+template <typename TImage>
+void IntensityMatching<TImage>::ComputeStatistics(const ImageType *fixed, const ImageType *moving, unsigned int matchPoints, size_t maximumSamples,
+                                                  unsigned int threads, Statistics *fixedStatistics, Statistics *movingStatistics) {
+    // Both images are split into chunks and the chunks of both go through
+    // one work queue. Each chunk keeps its own sums and samples so the
+    // result does not depend on which worker took it.
+    struct Chunk {
+        double sum;
+        double sumOfSquares;
+        double minimum;
+        double maximum;
+        std::vector<float> samples;
+    };
+    const ImageType *images[2] = { fixed, moving };
+    size_t voxels[2];
+    size_t strides[2];
+    size_t chunkCounts[2];
+    for (unsigned int i = 0; i < 2; i++) {
+        voxels[i] = images[i] ? images[i]->GetBufferedRegion().GetNumberOfPixels() : 0;
+        strides[i] = maximumSamples > 0 ? std::max<size_t>(1, (voxels[i] + maximumSamples - 1) / maximumSamples) : 1;
+        chunkCounts[i] = (voxels[i] + ChunkSize() - 1) / ChunkSize();
+    }
+    std::vector<Chunk> chunks(chunkCounts[0] + chunkCounts[1]);
+
+    std::atomic<size_t> nextChunk(0);
+    auto worker = [&]() {
+        for (size_t chunk = nextChunk++; chunk < chunks.size(); chunk = nextChunk++) {
+            const unsigned int image = chunk < chunkCounts[0] ? 0 : 1;
+            const size_t begin = (image == 0 ? chunk : chunk - chunkCounts[0]) * ChunkSize();
+            const size_t end = std::min(voxels[image], begin + ChunkSize());
+            const PixelType *pixels = images[image]->GetBufferPointer();
+            Chunk &result = chunks[chunk];
+            result.sum = 0;
+            result.sumOfSquares = 0;
+            result.minimum = std::numeric_limits<double>::max();
+            result.maximum = -std::numeric_limits<double>::max();
+            for (size_t v = begin; v < end; v++) {
+                const double value = pixels[v];
+                result.sum += value;
+                result.sumOfSquares += value * value;
+                result.minimum = std::min(result.minimum, value);
+                result.maximum = std::max(result.maximum, value);
+            }
+            for (size_t v = (begin + strides[image] - 1) / strides[image] * strides[image]; v < end; v += strides[image]) {
+                result.samples.push_back(static_cast<float>(pixels[v]));
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < std::max(1u, threads); i++) {
+        workers.push_back(std::thread(worker));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    // Combine the chunks in order, then take the quantiles above the mean
+    Statistics *statistics[2] = { fixedStatistics, movingStatistics };
+    size_t firstChunk = 0;
+    for (unsigned int image = 0; image < 2; image++) {
+        if (!images[image]) {
+            continue;
+        }
+        double sum = 0;
+        double sumOfSquares = 0;
+        double minimum = std::numeric_limits<double>::max();
+        double maximum = -std::numeric_limits<double>::max();
+        for (size_t chunk = firstChunk; chunk < firstChunk + chunkCounts[image]; chunk++) {
+            sum += chunks[chunk].sum;
+            sumOfSquares += chunks[chunk].sumOfSquares;
+            minimum = std::min(minimum, chunks[chunk].minimum);
+            maximum = std::max(maximum, chunks[chunk].maximum);
+        }
+        const double count = static_cast<double>(std::max<size_t>(1, voxels[image]));
+        Statistics &result = *statistics[image];
+        result.mean = sum / count;
+        result.sigma = count > 1 ? std::sqrt(std::max(0.0, (sumOfSquares - sum * sum / count) / (count - 1))) : 0.0;
+        result.minimum = std::min(result.mean, minimum);
+
+        std::vector<float> above;
+        for (size_t chunk = firstChunk; chunk < firstChunk + chunkCounts[image]; chunk++) {
+            for (size_t s = 0; s < chunks[chunk].samples.size(); s++) {
+                if (chunks[chunk].samples[s] > result.mean) {
+                    above.push_back(chunks[chunk].samples[s]);
+                }
+            }
+        }
+        std::sort(above.begin(), above.end());
+        result.quantiles.assign(matchPoints + 2, result.mean);
+        result.quantiles.back() = std::max(result.mean, maximum);
+        for (unsigned int point = 1; point <= matchPoints && !above.empty(); point++) {
+            const size_t rank = static_cast<size_t>(static_cast<double>(point) / (matchPoints + 1) * (above.size() - 1) + 0.5);
+            result.quantiles[point] = above[rank];
+        }
+        firstChunk += chunkCounts[image];
+    }
+}
+
+template <typename TImage>
+void IntensityMatching<TImage>::Apply(const ImageType *fixed, const ImageType *moving, const Statistics &fixedStatistics, const Statistics &movingStatistics,
+                                      unsigned int threads, ImagePointer *normalizedFixed, ImagePointer *matchedMoving) {
+    // Match points in the normalized fixed intensities
+    const double scale = fixedStatistics.sigma > 0 ? 1.0 / fixedStatistics.sigma : 1.0;
+    const std::vector<double> &source = movingStatistics.quantiles;
+    std::vector<double> target(fixedStatistics.quantiles.size());
+    for (size_t point = 0; point < target.size(); point++) {
+        target[point] = (fixedStatistics.quantiles[point] - fixedStatistics.mean) * scale;
+    }
+    if (source.size() != target.size() || source.size() < 2) {
+        itkGenericExceptionMacro(<< "Intensity matching needs the same number of quantiles, at least two, for both images");
+    }
+
+    // Below the mean, [minimum, mean] maps onto the fixed [minimum, mean];
+    // above the maximum, the last segment's slope carries on
+    const size_t last = source.size() - 1;
+    const double targetMinimum = (fixedStatistics.minimum - fixedStatistics.mean) * scale;
+    const double lowerGradient = source[0] > movingStatistics.minimum ? (target[0] - targetMinimum) / (source[0] - movingStatistics.minimum) : 0.0;
+    const double upperGradient = source[last] > source[last - 1] ? (target[last] - target[last - 1]) / (source[last] - source[last - 1]) : 0.0;
+    auto match = [&](double value) -> double {
+        if (value <= source[0]) {
+            return target[0] + (value - source[0]) * lowerGradient;
+        }
+        if (value >= source[last]) {
+            return target[last] + (value - source[last]) * upperGradient;
+        }
+        const size_t upper = std::upper_bound(source.begin(), source.end(), value) - source.begin();
+        const double width = source[upper] - source[upper - 1];
+        return width > 0 ? target[upper - 1] + (value - source[upper - 1]) * (target[upper] - target[upper - 1]) / width : target[upper - 1];
+    };
+
+    const ImageType *images[2] = { fixed, moving };
+    PixelType *outputs[2] = { ITK_NULLPTR, ITK_NULLPTR };
+    size_t voxels[2];
+    size_t chunkCounts[2];
+    if (fixed) {
+        *normalizedFixed = AllocateLike(fixed);
+        outputs[0] = (*normalizedFixed)->GetBufferPointer();
+    }
+    *matchedMoving = AllocateLike(moving);
+    outputs[1] = (*matchedMoving)->GetBufferPointer();
+    for (unsigned int i = 0; i < 2; i++) {
+        voxels[i] = images[i] ? images[i]->GetBufferedRegion().GetNumberOfPixels() : 0;
+        chunkCounts[i] = (voxels[i] + ChunkSize() - 1) / ChunkSize();
+    }
+
+    std::atomic<size_t> nextChunk(0);
+    const size_t totalChunks = chunkCounts[0] + chunkCounts[1];
+    auto worker = [&]() {
+        for (size_t chunk = nextChunk++; chunk < totalChunks; chunk = nextChunk++) {
+            const unsigned int image = chunk < chunkCounts[0] ? 0 : 1;
+            const size_t begin = (image == 0 ? chunk : chunk - chunkCounts[0]) * ChunkSize();
+            const size_t end = std::min(voxels[image], begin + ChunkSize());
+            const PixelType *in = images[image]->GetBufferPointer();
+            PixelType *out = outputs[image];
+            if (image == 0) {
+                for (size_t v = begin; v < end; v++) {
+                    out[v] = static_cast<PixelType>((in[v] - fixedStatistics.mean) * scale);
+                }
+            }
+            else {
+                for (size_t v = begin; v < end; v++) {
+                    out[v] = static_cast<PixelType>(match(in[v]));
+                }
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < std::max(1u, threads); i++) {
+        workers.push_back(std::thread(worker));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <vector>
+#include <itkImage.h>
+
+// Normalization and histogram matching of a fixed and a moving image in two
+// sweeps instead of the five that NormalizeImageFilter twice plus
+// HistogramMatchingImageFilter take. One parallel pass gathers the mean,
+// deviation, maximum and a strided sample of each image; one pass writes the
+// normalized fixed image and the moving image mapped onto its intensities.
+// Matching is piecewise linear between quantiles of the voxels above each
+// image's mean, as HistogramMatchingImageFilter does with
+// ThresholdAtMeanIntensity on; below the mean, [minimum, mean] maps
+// linearly onto the fixed image's [minimum, mean]. Quantiles come from a
+// strided sample rather than a full histogram. Matching does not depend on
+// the moving image's scale, so the moving image needs no normalization of
+// its own.
+template <typename TImage>
+class IntensityMatching
+{
+public:
+    typedef TImage ImageType;
+    typedef typename ImageType::Pointer ImagePointer;
+    typedef typename ImageType::PixelType PixelType;
+
+    struct Statistics {
+        double mean;
+        double sigma;
+        double minimum;
+        // Intensities at evenly spaced ranks of the voxels above the mean,
+        // from the mean itself up to the maximum
+        std::vector<double> quantiles;
+    };
+
+    // Statistics of both images in a single pass; either image may be null
+    // when its statistics are already known. Quantiles come from at most
+    // maximumSamples evenly strided voxels per image, 0 for every voxel.
+    static void ComputeStatistics(const ImageType *fixed, const ImageType *moving, unsigned int matchPoints, size_t maximumSamples,
+                                  unsigned int threads, Statistics *fixedStatistics, Statistics *movingStatistics);
+
+    // Write (fixed - mean) / sigma and the matched moving image in a single
+    // pass. The fixed image may be null when it is already normalized; the
+    // moving image is always matched to the normalized fixed intensities.
+    static void Apply(const ImageType *fixed, const ImageType *moving, const Statistics &fixedStatistics, const Statistics &movingStatistics,
+                      unsigned int threads, ImagePointer *normalizedFixed, ImagePointer *matchedMoving);
+
+protected:
+    // Voxels handed to a worker at a time
+    static size_t ChunkSize() { return 1 << 16; }
+
+    // Output with the geometry of image, allocated but not filled
+    static ImagePointer AllocateLike(const ImageType *image);
+};
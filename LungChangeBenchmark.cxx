@@ -0,0 +1,409 @@
+#include "RegistrationCache.h"
+#include "RegistrationCache.cxx"
+#include "RegisterOrganFilter.h"
+#include "RegisterOrganFilter.cxx"
+#include "NonlinearRegisterOrganFilter.h"
+#include "NonlinearRegisterOrganFilter.cxx"
+#include "RoundingInterpolateImageFunction.h"
+#include "RoundingInterpolateImageFunction.cxx"
+#include "ParallelSeriesReader.h"
+#include "ParallelSeriesReader.cxx"
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <itkImage.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageSeriesWriter.h>
+#include <itkNumericSeriesFileNames.h>
+#include <itksys/SystemTools.hxx>
+#include "SegmentLungVolume.h"
+#include "SegmentLungVolume.cxx"
+#include "MaskedDifferenceImageFilter.h"
+#include "MaskedDifferenceImageFilter.cxx"
+
+#define DIMENSION 3
+
+// Times each pipeline stage on synthetic chest phantoms. The later phantom is
+// the baseline under a known smooth deformation plus a translation, with one
+// added nodule, so the registration has real work to do and the change map
+// has a known change in it. Results are written as JSON.
+
+namespace {
+
+const int threshold = 410;
+const double variance = 2.0;
+
+typedef itk::Image<float, DIMENSION> ImageType;
+typedef itk::Image<float, 2> SliceType;
+typedef itk::Image<unsigned char, DIMENSION> MaskImageType;
+typedef ParallelSeriesReader<ImageType> ReaderType;
+typedef itk::ImageSeriesWriter<ImageType, SliceType> SliceWriterType;
+typedef itk::ImageSeriesWriter<ImageType, ImageType> WriterType;
+typedef itk::NumericSeriesFileNames NameGeneratorType;
+typedef std::chrono::steady_clock Clock;
+
+struct Settings {
+    std::vector<ImageType::SizeType> sizes;
+    std::vector<unsigned int> threads;
+    unsigned int repeats = 1;
+    unsigned int demonsIterations = 50;
+    std::string workDirectory = "LungChangeBenchmark.work";
+    std::string output = "LungChangeBenchmark.json";
+};
+
+struct Timing {
+    ImageType::SizeType size;
+    unsigned int threads;
+    unsigned int repeat;
+    std::vector<std::pair<std::string, double> > stages;
+    double residual;
+};
+
+ImageType::SizeType MakeSize(unsigned int x, unsigned int y, unsigned int z) {
+    ImageType::SizeType size;
+    size[0] = x;
+    size[1] = y;
+    size[2] = z;
+    return size;
+}
+
+// Parse "128,256,512x512x400" into sizes; a single number means a cube
+bool ParseSizes(const std::string& text, std::vector<ImageType::SizeType>& sizes) {
+    std::stringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        unsigned int x = 0, y = 0, z = 0;
+        char separator;
+        std::stringstream parts(item);
+        if (!(parts >> x)) {
+            return false;
+        }
+        if (parts >> separator >> y >> separator >> z) {
+            sizes.push_back(MakeSize(x, y, z));
+        }
+        else {
+            sizes.push_back(MakeSize(x, x, x));
+        }
+    }
+    return !sizes.empty();
+}
+
+bool ParseThreads(const std::string& text, std::vector<unsigned int>& threads) {
+    std::stringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        threads.push_back(std::max(1, std::stoi(item)));
+    }
+    return !threads.empty();
+}
+
+double Square(double value) {
+    return value * value;
+}
+
+// Intensity of the phantom at a point given in voxels: air around a body
+// ellipse with two lungs, a few vessels, and optionally a nodule in the right lung
+float PhantomValue(double x, double y, double z, const ImageType::SizeType& size, bool nodule) {
+    // Normalize to [-1, 1] along each axis
+    const double u = 2.0 * x / size[0] - 1.0;
+    const double v = 2.0 * y / size[1] - 1.0;
+    const double w = 2.0 * z / size[2] - 1.0;
+
+    if (Square(u / 0.9) + Square(v / 0.7) > 1.0 || std::abs(w) > 0.95) {
+        return 0.0f;
+    }
+    const double lungU = std::abs(u) - 0.42;
+    const double inLung = Square(lungU / 0.32) + Square(v / 0.5) + Square(w / 0.85);
+    if (inLung > 1.0) {
+        return 1040.0f;
+    }
+    if (nodule && Square(u - 0.4) + Square(v - 0.1) + Square(w - 0.2) < Square(0.06)) {
+        return 1000.0f;
+    }
+    // Vessels run along the slice axis and give the registration something to lock onto
+    for (int vessel = 0; vessel < 4; vessel++) {
+        const double vesselU = (u < 0 ? -1.0 : 1.0) * (0.3 + 0.08 * vessel);
+        const double vesselV = -0.3 + 0.2 * vessel + 0.05 * std::sin(3.0 * w);
+        if (Square(u - vesselU) + Square(v - vesselV) < Square(0.025)) {
+            return 900.0f;
+        }
+    }
+    return 120.0f;
+}
+
+// Build a phantom. The later phantom is sampled through a smooth known
+// deformation of up to 'amplitude' voxels and shifted by 'shift' voxels.
+ImageType::Pointer MakePhantom(const ImageType::SizeType& size, bool later) {
+    ImageType::Pointer image = ImageType::New();
+    ImageType::RegionType region;
+    region.SetSize(size);
+    image->SetRegions(region);
+    image->Allocate();
+
+    const double amplitude = later ? 0.02 * size[0] : 0.0;
+    const double shift = later ? 0.01 * size[0] : 0.0;
+    const double pi = 3.14159265358979323846;
+    itk::ImageRegionIteratorWithIndex<ImageType> it(image, region);
+    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+        const ImageType::IndexType& index = it.GetIndex();
+        const double x = index[0] - shift - amplitude * std::sin(pi * index[2] / size[2]);
+        const double y = index[1] - amplitude * std::sin(pi * index[0] / size[0]);
+        const double z = index[2];
+        it.Set(PhantomValue(x, y, z, size, later));
+    }
+    return image;
+}
+
+std::vector<std::string> FileNames(const std::string& format, unsigned int count) {
+    NameGeneratorType::Pointer nameGenerator = NameGeneratorType::New();
+    nameGenerator->SetSeriesFormat(format);
+    nameGenerator->SetStartIndex(1);
+    nameGenerator->SetEndIndex(count);
+    nameGenerator->SetIncrementIndex(1);
+    return nameGenerator->GetFileNames();
+}
+
+// Write a phantom as a numbered slice series, like the scanner exports we ingest
+std::vector<std::string> WriteSeries(ImageType *image, const std::string& format) {
+    std::vector<std::string> fileNames = FileNames(format, image->GetLargestPossibleRegion().GetSize()[2]);
+    SliceWriterType::Pointer writer = SliceWriterType::New();
+    writer->SetInput(image);
+    writer->SetFileNames(fileNames);
+    writer->Update();
+    return fileNames;
+}
+
+ImageType::Pointer ReadSeries(const std::vector<std::string>& fileNames, unsigned int threads) {
+    ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileNames(fileNames);
+    reader->SetNumberOfWorkers(threads);
+    reader->Update();
+    ImageType::Pointer image = reader->GetOutput();
+    image->DisconnectPipeline();
+    return image;
+}
+
+// Mean absolute change inside the lungs; drops as registration improves
+double MeanAbsoluteChange(const ImageType *difference, const MaskImageType *mask) {
+    itk::ImageRegionConstIterator<ImageType> it(difference, difference->GetLargestPossibleRegion());
+    itk::ImageRegionConstIterator<MaskImageType> maskIt(mask, mask->GetLargestPossibleRegion());
+    double sum = 0.0;
+    size_t count = 0;
+    for (; !it.IsAtEnd(); ++it, ++maskIt) {
+        if (maskIt.Get() != 0) {
+            sum += std::abs(it.Get());
+            count++;
+        }
+    }
+    return count ? sum / count : 0.0;
+}
+
+// Run every stage once and record its wall time
+Timing RunOnce(const std::vector<std::string>& baselineFiles, const std::vector<std::string>& laterFiles,
+               const std::string& outputFile, const Settings& settings, unsigned int threads) {
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads);
+    Timing timing;
+    timing.threads = threads;
+    Clock::time_point start = Clock::now();
+    auto lap = [&](const std::string& stage) {
+        const Clock::time_point now = Clock::now();
+        timing.stages.push_back(std::make_pair(stage, std::chrono::duration<double>(now - start).count()));
+        start = now;
+    };
+
+    std::future<ImageType::Pointer> laterLoad = std::async(std::launch::async, ReadSeries, laterFiles, std::max(1u, threads / 2));
+    ImageType::Pointer baseline = ReadSeries(baselineFiles, std::max(1u, threads / 2));
+    ImageType::Pointer later = laterLoad.get();
+    timing.size = baseline->GetLargestPossibleRegion().GetSize();
+    lap("ingestion");
+
+    RegisterOrganFilter<ImageType, ImageType>::Pointer reg = RegisterOrganFilter<ImageType, ImageType>::New();
+    reg->SetNumberOfThreads(threads);
+    reg->SetFixedImage(baseline);
+    reg->SetMovingImage(later);
+    reg->Update();
+    lap("affine");
+
+    NonlinearRegisterOrganFilter<ImageType, ImageType>::Pointer nonlinearReg = NonlinearRegisterOrganFilter<ImageType, ImageType>::New();
+    nonlinearReg->SetNumberOfThreads(threads);
+    nonlinearReg->SetFixedImage(baseline);
+    nonlinearReg->SetMovingImage(reg->GetOutput());
+    nonlinearReg->ClearDemonsLevels();
+    nonlinearReg->AddDemonsLevel(4, 1, settings.demonsIterations);
+    nonlinearReg->Update();
+    lap("demons");
+
+    SegmentLungVolume<ImageType, MaskImageType>::Pointer segBaseline = SegmentLungVolume<ImageType, MaskImageType>::New();
+    segBaseline->SetNumberOfThreads(threads);
+    segBaseline->SetInput(baseline);
+    segBaseline->SetThreshold(threshold);
+    segBaseline->SetVariance(variance);
+    segBaseline->Update();
+    SegmentLungVolume<ImageType, MaskImageType>::Pointer segLater = SegmentLungVolume<ImageType, MaskImageType>::New();
+    segLater->SetNumberOfThreads(threads);
+    segLater->SetInput(nonlinearReg->GetOutput());
+    segLater->SetThreshold(threshold);
+    segLater->SetVariance(variance);
+    segLater->Update();
+    lap("segmentation");
+
+    typedef MaskedDifferenceImageFilter<ImageType, MaskImageType, ImageType> DifferenceFilterType;
+    DifferenceFilterType::Pointer difference = DifferenceFilterType::New();
+    difference->SetNumberOfThreads(threads);
+    difference->SetBaselineImage(baseline);
+    difference->SetLaterImage(nonlinearReg->GetOutput());
+    difference->SetBaselineMask(segBaseline->GetOutput());
+    difference->SetLaterMask(segLater->GetOutput());
+    difference->Update();
+    lap("difference");
+
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(difference->GetOutput());
+    writer->SetFileNames(std::vector<std::string>(1, outputFile));
+    writer->Update();
+    lap("write");
+
+    timing.residual = MeanAbsoluteChange(difference->GetOutput(), segBaseline->GetOutput());
+    return timing;
+}
+
+void WriteJson(std::ostream& out, const std::vector<Timing>& timings) {
+    out << "{\n";
+    out << "  \"benchmark\": \"LungChangeDetector\",\n";
+    out << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+    out << "  \"runs\": [\n";
+    for (size_t i = 0; i < timings.size(); i++) {
+        const Timing& timing = timings[i];
+        const double voxels = static_cast<double>(timing.size[0]) * timing.size[1] * timing.size[2];
+        double total = 0.0;
+        out << "    {\n";
+        out << "      \"size\": [" << timing.size[0] << ", " << timing.size[1] << ", " << timing.size[2] << "],\n";
+        out << "      \"threads\": " << timing.threads << ",\n";
+        out << "      \"repeat\": " << timing.repeat << ",\n";
+        out << "      \"seconds\": {";
+        for (size_t s = 0; s < timing.stages.size(); s++) {
+            out << (s ? ", " : "") << "\"" << timing.stages[s].first << "\": " << timing.stages[s].second;
+            total += timing.stages[s].second;
+        }
+        out << ", \"total\": " << total << "},\n";
+        out << "      \"megavoxels_per_second\": {";
+        for (size_t s = 0; s < timing.stages.size(); s++) {
+            out << (s ? ", " : "") << "\"" << timing.stages[s].first << "\": " << (timing.stages[s].second > 0 ? voxels / 1e6 / timing.stages[s].second : 0.0);
+        }
+        out << "},\n";
+        out << "      \"mean_abs_lung_change\": " << timing.residual << "\n";
+        out << "    }" << (i + 1 < timings.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+void PrintUsage() {
+    std::cout << "USAGE: " << std::endl;
+    std::cout << "LungChangeBenchmark.exe [Options]" << std::endl << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "--sizes <List> -- Phantom sizes, e.g. 128,256,512x512x400 (default 128,256)." << std::endl;
+    std::cout << "--threads <List> -- Thread counts to time, e.g. 1,4,8 (default 1 and all cores)." << std::endl;
+    std::cout << "--repeat <Count> -- Runs per size and thread count (default 1)." << std::endl;
+    std::cout << "--demons-iterations <Count> -- Demons iterations at 1/4 in-plane resolution (default 50)." << std::endl;
+    std::cout << "--work-dir <Directory> -- Where phantom series and outputs are written." << std::endl;
+    std::cout << "--output <File> -- JSON results (default LungChangeBenchmark.json)." << std::endl;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Settings settings;
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        bool valid = true;
+        if (option == "--sizes" && i + 1 < argc) {
+            valid = ParseSizes(argv[++i], settings.sizes);
+        }
+        else if (option == "--threads" && i + 1 < argc) {
+            valid = ParseThreads(argv[++i], settings.threads);
+        }
+        else if (option == "--repeat" && i + 1 < argc) {
+            settings.repeats = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (option == "--demons-iterations" && i + 1 < argc) {
+            settings.demonsIterations = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (option == "--work-dir" && i + 1 < argc) {
+            settings.workDirectory = argv[++i];
+        }
+        else if (option == "--output" && i + 1 < argc) {
+            settings.output = argv[++i];
+        }
+        else {
+            valid = false;
+        }
+        if (!valid) {
+            PrintUsage();
+            return 1;
+        }
+    }
+    if (settings.sizes.empty()) {
+        settings.sizes.push_back(MakeSize(128, 128, 128));
+        settings.sizes.push_back(MakeSize(256, 256, 256));
+    }
+    if (settings.threads.empty()) {
+        settings.threads.push_back(1);
+        const unsigned int cores = std::thread::hardware_concurrency();
+        if (cores > 1) {
+            settings.threads.push_back(cores);
+        }
+    }
+
+    std::vector<Timing> timings;
+    try {
+        itksys::SystemTools::MakeDirectory(settings.workDirectory);
+        for (size_t s = 0; s < settings.sizes.size(); s++) {
+            const ImageType::SizeType& size = settings.sizes[s];
+            std::ostringstream prefix;
+            prefix << settings.workDirectory << "/" << size[0] << "x" << size[1] << "x" << size[2];
+
+            // Phantom generation and export are not timed
+            std::cout << "Generating " << size[0] << "x" << size[1] << "x" << size[2] << " phantoms" << std::endl;
+            std::vector<std::string> baselineFiles = WriteSeries(MakePhantom(size, false), prefix.str() + "_baseline_%d.mha");
+            std::vector<std::string> laterFiles = WriteSeries(MakePhantom(size, true), prefix.str() + "_later_%d.mha");
+
+            for (size_t t = 0; t < settings.threads.size(); t++) {
+                for (unsigned int repeat = 0; repeat < settings.repeats; repeat++) {
+                    Timing timing = RunOnce(baselineFiles, laterFiles, prefix.str() + "_change.mha", settings, settings.threads[t]);
+                    timing.repeat = repeat;
+                    timings.push_back(timing);
+
+                    std::cout << size[0] << "x" << size[1] << "x" << size[2] << " threads " << settings.threads[t] << ":";
+                    for (size_t stage = 0; stage < timing.stages.size(); stage++) {
+                        std::cout << " " << timing.stages[stage].first << " " << timing.stages[stage].second << "s";
+                    }
+                    std::cout << std::endl;
+                }
+            }
+        }
+    }
+    catch (itk::ExceptionObject &e) {
+        std::cout << e.GetDescription() << std::endl;
+        return 1;
+    }
+    catch (std::exception &e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+
+    std::ofstream out(settings.output.c_str());
+    if (!out) {
+        std::cout << "Could not write " << settings.output << std::endl;
+        return 1;
+    }
+    WriteJson(out, timings);
+    return 0;
+}
@@ -1,7 +1,29 @@
+#include "RegistrationCache.h"
+#include "RegistrationCache.cxx"
 #include "RegisterOrganFilter.h"
 #include "RegisterOrganFilter.cxx"
 #include "NonlinearRegisterOrganFilter.h"
 #include "NonlinearRegisterOrganFilter.cxx"
+#include "RoundingInterpolateImageFunction.h"
+#include "RoundingInterpolateImageFunction.cxx"
+#include "ParallelSeriesReader.h"
+#include "ParallelSeriesReader.cxx"
+#include "VolumeCache.h"
+#include "VolumeCache.cxx"
+#include "TaskGraph.h"
+#include "StageTrace.h"
+#include "LungRegionOfInterest.h"
+#include "LungRegionOfInterest.cxx"
+#include "SparseChangeMap.h"
+#include "SparseChangeMap.cxx"
+#include <future>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
 #include <iostream>
 #include <vector>
 #include <string>
@@ -20,140 +42,831 @@
 #include <itkTranslationTransform.h>
 #include <itkCenteredTransformInitializer.h>
 #include <itkShrinkImageFilter.h>
+#include <itkImageIOFactory.h>
+#include <itkStreamingImageFilter.h>
+#include <itkConstantPadImageFilter.h>
+#include <itkImageFileWriter.h>
 #include "SegmentLungVolume.h"
 #include "SegmentLungVolume.cxx"
-#include <itkMaskImageFilter.h>
-#include <itkSubtractImageFilter.h>
+#include "MaskedDifferenceImageFilter.h"
+#include "MaskedDifferenceImageFilter.cxx"
 
 #define DIMENSION 3
 #define OUT_DIMENSION 3
 
-int main(int argc, char **argv) {
-	const int threshold = 410;
-	const double variance = 2.0;
-	const int invertMax = 255;
-
-    // Define types
-    typedef itk::Image<float, DIMENSION> ImageType;
-    typedef itk::ImageSeriesReader<ImageType> ReaderType;
-    typedef itk::NumericSeriesFileNames NameGeneratorType;
-    typedef itk::Image<float, OUT_DIMENSION> OutputImageType;
-    typedef itk::ImageSeriesWriter<ImageType, OutputImageType> WriterType;
-
-    
-    // Define variables
+namespace {
+
+const int threshold = 410;
+const double variance = 2.0;
+const int invertMax = 255;
+
+// Define types. The pipeline runs on float or, with --int16, on the signed
+// 16-bit values CT is stored as; registration converts to float internally.
+typedef itk::Image<float, DIMENSION> FloatImageType;
+typedef itk::Image<short, DIMENSION> ShortImageType;
+typedef itk::NumericSeriesFileNames NameGeneratorType;
+typedef itk::Image<unsigned char, DIMENSION> MaskImageType;
+
+// Approximate bytes held per input voxel at the peak of a pair: both
+// inputs, the affine and Demons outputs, the two smoothed images and the
+// difference image in the pipeline's pixel type, plus the morphology masks.
+// In low-memory mode the affine output and the smoothed images are gone by
+// the time the difference is allocated, and the masks are cast in place.
+double BytesPerVoxel(size_t pixelSize, bool lowMemory) {
+    return lowMemory ? 4.0 * pixelSize + 4.0 : 7.0 * pixelSize + 8.0;
+}
+
+// A later series and the change map written for it
+struct FollowUp {
+    std::string laterFormat;
+    int laterStart;
+    int laterEnd;
+    std::string outputFormat;
+};
+
+// A baseline series compared with one or more follow-ups
+struct PairJob {
+    std::string baselineFormat;
+    int baselineStart;
+    int baselineEnd;
+    std::vector<FollowUp> followUps;
+};
+
+// Settings shared by every pair
+struct PipelineOptions {
+    bool usePyramid = false;
+    bool useDemonsSchedule = false;
+    bool composeTransforms = false;
+    bool useRegionOfInterest = false;
+    bool useFastMorphology = false;
+    bool useRecursiveGaussian = false;
+    bool useFastMatching = false;
+    bool useInt16 = false;
+    bool lowMemory = false;
+    unsigned int streamSlabs = 1;
+    RegisterOrganFilterEnums::SimilarityMetricType similarityMetric = RegisterOrganFilterEnums::ViolaWellsMutualInformation;
+    unsigned int affineStarts = 1;
+    std::string cacheDirectory;
+    std::string registrationCacheDirectory;
+    unsigned int threadBudget = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+    // Batch mode only
+    std::string manifest;
+    unsigned int jobs = 1;
+    double maximumJobMemoryMB = 0;
+
+    // Extra follow-ups from the command line
+    std::vector<FollowUp> followUps;
+
+    // Write change maps block-sparse and compressed instead of dense
+    bool sparseOutput = false;
+
+    // Write regional change statistics as JSON next to each change map
+    bool writeStatistics = false;
+
+    // Stage timing output
+    std::string traceFile;
+    bool traceSummary = false;
+
+    // Peak resident memory allowed for the whole process; 0 for no check
+    double memoryBudgetMB = 0;
+};
+
+// Change map file name with its extension replaced by .json
+std::string StatisticsFileName(const std::string &outputFile) {
+    const size_t dot = outputFile.find_last_of('.');
+    const size_t slash = outputFile.find_last_of("/\\");
+    const bool hasExtension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+    return (hasExtension ? outputFile.substr(0, dot) : outputFile) + ".json";
+}
+
+// Bytes held by an image's pixel buffer
+template <typename TImage>
+size_t BufferBytes(const TImage *image) {
+    return image->GetBufferedRegion().GetNumberOfPixels() * sizeof(typename TImage::PixelType);
+}
+
+void PrintUsage() {
+    std::cout << "USAGE: " << std::endl;
+    std::cout << "LungChangeDetector.exe <File Path Template for Set 1> <Start Index> <End Index> <File Path Template for Set 2> <Start Index> <End Index> <Output Path Template> [Options]" << std::endl;
+    std::cout << "LungChangeDetector.exe --batch <Manifest> [Options]" << std::endl;
+    std::cout << "File Path Template X -- A standardized file name/path for each numbered image" << std::endl;
+    std::cout << "      with \"%d\" standing in for the number, such as \"C:\\foo %d.tif\" for" << std::endl;
+    std::cout << "      files foo 1.tif, foo 2.tif, etc." << std::endl;
+    std::cout << "Start Index -- Number of the first image." << std::endl;
+    std::cout << "End Index -- Number of the last image." << std::endl;
+    std::cout << "Manifest -- CSV file with one pair per line, in the same seven fields as the" << std::endl;
+    std::cout << "      positional arguments. Blank lines and lines starting with # are skipped." << std::endl << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "--pyramid -- Run the affine registration coarse-to-fine at 1/8, 1/4 and 1/2 resolution." << std::endl;
+    std::cout << "--cache-dir <Directory> -- Keep assembled input volumes in this directory and map them on later runs." << std::endl;
+    std::cout << "--threads <Count> -- Total threads shared by the pipeline stages that run at the same time." << std::endl;
+    std::cout << "--registration-cache <Directory> -- Reuse affine and Demons results for identical inputs and settings." << std::endl;
+    std::cout << "--demons-schedule -- Run Demons at 1/8 then 1/4 in-plane resolution and stop each level once it converges." << std::endl;
+    std::cout << "--compose-transforms -- Resample the later image once with the composed affine and Demons transforms." << std::endl;
+    std::cout << "--roi -- Process only a padded box around the lungs and paste the result into the full-size output." << std::endl;
+    std::cout << "--fast-morphology -- Clean up the lung masks with distance transforms instead of structuring elements." << std::endl;
+    std::cout << "--recursive-gaussian -- Smooth with a recursive Gaussian whose cost does not grow with the variance." << std::endl;
+    std::cout << "--fast-matching -- Normalize and match the Demons levels' intensities in two passes from sampled quantiles." << std::endl;
+    std::cout << "--int16 -- Read, segment, subtract and write signed 16-bit values instead of float." << std::endl;
+    std::cout << "--low-memory -- Free each intermediate volume as soon as the next stage has used it and load" << std::endl;
+    std::cout << "      follow-ups one at a time. Slower with several follow-ups, but the peak is much lower." << std::endl;
+    std::cout << "--stream-slabs <Count> -- Warp, segment, subtract and write the later image in this many slabs along z once" << std::endl;
+    std::cout << "      the registration is estimated. Slabs go straight to the file only for formats that write in pieces," << std::endl;
+    std::cout << "      such as MetaImage (.mha); other formats, --sparse-output, --fast-morphology and --recursive-gaussian" << std::endl;
+    std::cout << "      still hold a whole volume at some stage." << std::endl;
+    std::cout << "--memory-budget <MB> -- Report peak resident memory against this budget and fail if it is exceeded;" << std::endl;
+    std::cout << "      in batch mode it also limits each pair's estimated memory to its share, unless --max-job-memory is given." << std::endl;
+    std::cout << "--metric <viola-wells|mattes|correlation|mean-squares> -- Similarity metric for the affine registration." << std::endl;
+    std::cout << "--multi-start <Count> -- Try this many starting poses at the coarsest affine level at once and refine the best." << std::endl;
+    std::cout << "--jobs <Count> -- Batch mode: pairs processed at the same time; --threads is split between them." << std::endl;
+    std::cout << "--max-job-memory <MB> -- Batch mode: fail pairs whose estimated peak memory is above this." << std::endl;
+    std::cout << "--followup <File Path Template> <Start Index> <End Index> <Output Path Template> -- Also compare" << std::endl;
+    std::cout << "      this series with the baseline; may be repeated. The baseline is prepared only once. Not valid with --batch." << std::endl;
+    std::cout << "--sparse-output -- Write change maps as compressed blocks, skipping all-zero blocks; read with ChangeMapTool." << std::endl;
+    std::cout << "--statistics -- Gather lung volumes, density change percentiles and per-slice summaries during the" << std::endl;
+    std::cout << "      subtraction and write them as JSON next to each change map (output.tif -> output.json)." << std::endl;
+    std::cout << "--trace <File> -- Write stage timings, memory and optimizer metrics as Chrome trace JSON." << std::endl;
+    std::cout << "--trace-summary -- Print a table of stage timings and peak memory at the end." << std::endl << std::endl;
+    std::cout << "For Example:" << std::endl;
+    std::cout << "LungChangeDetector.exe \"C:\\images\\baseline (%d).tif\" 1 404 \"C:\\images\\later (%d).tif\" 1 404 \"C:\\images\\output%d.tif\"" << std::endl;
+    std::cout << "To load files baseline (1).tif through baseline (404).tif" << std::endl;
+    std::cout << "and compare with later (1).tif through later (404).tif" << std::endl;
+}
+
+// Parse the optional flags from argv[first] on. Returns false on an unknown option.
+bool ParseOptions(int argc, char **argv, int first, PipelineOptions& options) {
+    for (int i = first; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--pyramid") {
+            options.usePyramid = true;
+        }
+        else if (option == "--demons-schedule") {
+            options.useDemonsSchedule = true;
+        }
+        else if (option == "--compose-transforms") {
+            options.composeTransforms = true;
+        }
+        else if (option == "--roi") {
+            options.useRegionOfInterest = true;
+        }
+        else if (option == "--fast-morphology") {
+            options.useFastMorphology = true;
+        }
+        else if (option == "--recursive-gaussian") {
+            options.useRecursiveGaussian = true;
+        }
+        else if (option == "--fast-matching") {
+            options.useFastMatching = true;
+        }
+        else if (option == "--int16") {
+            options.useInt16 = true;
+        }
+        else if (option == "--low-memory") {
+            options.lowMemory = true;
+        }
+        else if (option == "--stream-slabs" && i + 1 < argc) {
+            options.streamSlabs = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (option == "--memory-budget" && i + 1 < argc) {
+            options.memoryBudgetMB = std::stod(argv[++i]);
+        }
+        else if (option == "--metric" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "viola-wells") {
+                options.similarityMetric = RegisterOrganFilterEnums::ViolaWellsMutualInformation;
+            }
+            else if (name == "mattes") {
+                options.similarityMetric = RegisterOrganFilterEnums::MattesMutualInformation;
+            }
+            else if (name == "correlation") {
+                options.similarityMetric = RegisterOrganFilterEnums::NormalizedCorrelation;
+            }
+            else if (name == "mean-squares") {
+                options.similarityMetric = RegisterOrganFilterEnums::MeanSquares;
+            }
+            else {
+                std::cout << "Unknown metric: " << name << std::endl;
+                return false;
+            }
+        }
+        else if (option == "--multi-start" && i + 1 < argc) {
+            options.affineStarts = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (option == "--cache-dir" && i + 1 < argc) {
+            options.cacheDirectory = argv[++i];
+        }
+        else if (option == "--registration-cache" && i + 1 < argc) {
+            options.registrationCacheDirectory = argv[++i];
+        }
+        else if (option == "--threads" && i + 1 < argc) {
+            options.threadBudget = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (option == "--jobs" && i + 1 < argc) {
+            options.jobs = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (option == "--max-job-memory" && i + 1 < argc) {
+            options.maximumJobMemoryMB = std::stod(argv[++i]);
+        }
+        else if (option == "--trace" && i + 1 < argc) {
+            options.traceFile = argv[++i];
+        }
+        else if (option == "--sparse-output") {
+            options.sparseOutput = true;
+        }
+        else if (option == "--statistics") {
+            options.writeStatistics = true;
+        }
+        else if (option == "--trace-summary") {
+            options.traceSummary = true;
+        }
+        else if (option == "--followup" && i + 4 < argc) {
+            FollowUp followUp;
+            followUp.laterFormat = argv[++i];
+            followUp.laterStart = std::stoi(argv[++i]);
+            followUp.laterEnd = std::stoi(argv[++i]);
+            followUp.outputFormat = argv[++i];
+            options.followUps.push_back(followUp);
+        }
+        else {
+            std::cout << "Unknown option: " << option << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<std::string> GenerateFileNames(const std::string& format, int start, int end) {
     NameGeneratorType::Pointer nameGenerator = NameGeneratorType::New();
-    WriterType::Pointer writer = WriterType::New();
-    
-    // Accept input or display usage message
-    if (argc != 8) {
-        std::cout << "USAGE: " << std::endl;
-        std::cout << "LungChangeDetector.exe <File Path Template for Set 1> <Start Index> <End Index> <File Path Template for Set 2> <Start Index> <End Index> <Output Path Template>" << std::endl;
-        std::cout << "File Path Template X -- A standardized file name/path for each numbered image" << std::endl;
-        std::cout << "      with \"%d\" standing in for the number, such as \"C:\\foo %d.tif\" for" << std::endl;
-        std::cout << "      files foo 1.tif, foo 2.tif, etc." << std::endl;
-        std::cout << "Start Index -- Number of the first image." << std::endl;
-        std::cout << "End Index -- Number of the last image." << std::endl << std::endl;
-        std::cout << "For Example:" << std::endl;
-        std::cout << "LungChangeDetector.exe \"C:\\images\\baseline (%d).tif\" 1 404 \"C:\\images\\later (%d).tif\" 1 404 \"C:\\images\\output%d.tif\"" << std::endl;
-        std::cout << "To load files baseline (1).tif through baseline (404).tif" << std::endl;
-        std::cout << "and compare with later (1).tif through later (404).tif" << std::endl;
-        return 1;
+    nameGenerator->SetSeriesFormat(format);
+    nameGenerator->SetStartIndex(start);
+    nameGenerator->SetEndIndex(end);
+    nameGenerator->SetIncrementIndex(1);
+    return nameGenerator->GetFileNames();
+}
+
+// Split one manifest line on commas; fields may be wrapped in double quotes
+std::vector<std::string> SplitCsvLine(const std::string& line) {
+    std::vector<std::string> fields;
+    std::string field;
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); i++) {
+        const char c = line[i];
+        if (c == '"') {
+            quoted = !quoted;
+        }
+        else if (c == ',' && !quoted) {
+            fields.push_back(field);
+            field.clear();
+        }
+        else if (c != '\r') {
+            field += c;
+        }
     }
+    fields.push_back(field);
 
-    // Import Baseline Series
-    //
-    ReaderType::Pointer baselineReader = ReaderType::New();
+    // Trim surrounding spaces
+    for (size_t i = 0; i < fields.size(); i++) {
+        const size_t first = fields[i].find_first_not_of(" \t");
+        const size_t last = fields[i].find_last_not_of(" \t");
+        fields[i] = first == std::string::npos ? std::string() : fields[i].substr(first, last - first + 1);
+    }
+    return fields;
+}
 
-    // Generate file paths
-    nameGenerator->SetSeriesFormat(argv[1]);
-    nameGenerator->SetStartIndex(std::stoi(argv[2]));
-    nameGenerator->SetEndIndex(std::stoi(argv[3]));
-    nameGenerator->SetIncrementIndex(1);
-    std::vector<std::string> filePaths = nameGenerator->GetFileNames();
+// Read the pairs from a manifest. Malformed lines throw with their line number.
+std::vector<PairJob> ReadManifest(const std::string& path) {
+    std::ifstream manifest(path.c_str());
+    if (!manifest) {
+        throw std::runtime_error("Could not open manifest " + path);
+    }
+    std::vector<PairJob> jobs;
+    std::string line;
+    for (unsigned int lineNumber = 1; std::getline(manifest, line); lineNumber++) {
+        const size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') {
+            continue;
+        }
+        std::vector<std::string> fields = SplitCsvLine(line);
+        if (fields.size() != 7) {
+            throw std::runtime_error("Manifest line " + std::to_string(lineNumber) + " does not have 7 fields");
+        }
+        PairJob job;
+        job.baselineFormat = fields[0];
+        job.baselineStart = std::stoi(fields[1]);
+        job.baselineEnd = std::stoi(fields[2]);
+        FollowUp followUp;
+        followUp.laterFormat = fields[3];
+        followUp.laterStart = std::stoi(fields[4]);
+        followUp.laterEnd = std::stoi(fields[5]);
+        followUp.outputFormat = fields[6];
+        job.followUps.push_back(followUp);
+        jobs.push_back(job);
+    }
+    return jobs;
+}
 
-    // Load slice image files into memory with series reader.
-    baselineReader->SetFileNames(filePaths);
-    baselineReader->Update();
+// Voxel count of a series from the header of its first file
+double CountSeriesVoxels(const std::string& format, int start, int end) {
+    std::vector<std::string> fileNames = GenerateFileNames(format, start, start);
+    itk::ImageIOBase::Pointer io = itk::ImageIOFactory::CreateImageIO(fileNames[0].c_str(), itk::ImageIOFactory::ReadMode);
+    if (!io) {
+        throw std::runtime_error("Could not find a reader for " + fileNames[0]);
+    }
+    io->SetFileName(fileNames[0]);
+    io->ReadImageInformation();
+    double voxels = 1;
+    for (unsigned int d = 0; d < io->GetNumberOfDimensions(); d++) {
+        voxels *= io->GetDimensions(d);
+    }
+    return voxels * std::max(1, end - start + 1);
+}
 
-    // Import Later Series
-    //
-    ReaderType::Pointer laterReader = ReaderType::New();
+// Rough peak memory of a pair in MB, before any region of interest cropping
+double EstimatePairMemoryMB(const PairJob& job, size_t pixelSize, bool lowMemory) {
+    double voxels = CountSeriesVoxels(job.baselineFormat, job.baselineStart, job.baselineEnd);
+    for (size_t i = 0; i < job.followUps.size(); i++) {
+        voxels = std::max(voxels, CountSeriesVoxels(job.followUps[i].laterFormat, job.followUps[i].laterStart, job.followUps[i].laterEnd));
+    }
+    return voxels * BytesPerVoxel(pixelSize, lowMemory) / (1024.0 * 1024.0);
+}
 
-    // Generate file paths
-    nameGenerator->SetSeriesFormat(argv[4]);
-    nameGenerator->SetStartIndex(std::stoi(argv[5]));
-    nameGenerator->SetEndIndex(std::stoi(argv[6]));
-    nameGenerator->SetIncrementIndex(1);
-    filePaths = nameGenerator->GetFileNames();
+// Run the full pipeline for a baseline and each of its follow-ups in turn.
+// Baseline loading, cropping and segmentation and the fixed-side registration
+// preprocessing happen once; the next follow-up loads while the current one
+// is processed, except in low-memory mode, where each follow-up's volumes are
+// freed before the next one loads. Errors are thrown to the caller.
+template <typename ImageType>
+void RunPair(const PairJob& job, const PipelineOptions& options, VolumeCache<ImageType> *cache) {
+    const unsigned int threadBudget = options.threadBudget;
+    const bool useRegionOfInterest = options.useRegionOfInterest;
+    typedef typename ImageType::Pointer ImagePointer;
+    typedef ParallelSeriesReader<ImageType> ReaderType;
+    typedef itk::ImageSeriesWriter<ImageType, ImageType> WriterType;
+    typedef RegisterOrganFilter<ImageType, ImageType> RegistrationFilterType;
+    typedef NonlinearRegisterOrganFilter<ImageType, ImageType> NonlinearFilterType;
+    typedef SegmentLungVolume<ImageType, MaskImageType> SegmentFilterType;
+    typedef LungRegionOfInterest<ImageType> RegionOfInterestType;
 
-    // Load slice image files into memory with series reader.
-    laterReader->SetFileNames(filePaths);
-    laterReader->Update();
+    // Map a cached volume if there is one, otherwise decode the series and cache it
+    const unsigned int decodeWorkers = std::max(1u, threadBudget / 2);
+    auto loadSeries = [cache, decodeWorkers](const std::string& format, int start, int end) -> ImagePointer {
+        StageTrace::Scope load("load " + format);
+        typename ReaderType::Pointer reader = ReaderType::New();
+        reader->SetFileNames(GenerateFileNames(format, start, end));
+        reader->SetNumberOfWorkers(decodeWorkers);
+        std::string key;
+        if (cache) {
+            key = cache->MakeKey(format, start, end, reader->GetFileNames());
+            ImagePointer cached = cache->Load(key);
+            if (cached) {
+                load.SetBytes(BufferBytes(cached.GetPointer()));
+                return cached;
+            }
+        }
+        reader->Update();
+        ImagePointer image = reader->GetOutput();
+        image->DisconnectPipeline();
+        load.SetBytes(BufferBytes(image.GetPointer()));
+        if (cache && !cache->Store(key, image)) {
+            std::cout << "Could not write volume cache entry for " << format << std::endl;
+        }
+        return image;
+    };
 
-    try {
-        RegisterOrganFilter<ImageType, OutputImageType>::Pointer reg = RegisterOrganFilter<ImageType, OutputImageType>::New();
-        reg->SetFixedImage(baselineReader->GetOutput());
-        reg->SetMovingImage(laterReader->GetOutput());
-        reg->Update();
+    // Load a follow-up and optionally restrict it to a padded box around the
+    // lungs. The later box gets a wider margin so registration has room to move.
+    auto prepareFollowUp = [&](size_t index) -> ImagePointer {
+        const FollowUp& followUp = job.followUps[index];
+        ImagePointer later = loadSeries(followUp.laterFormat, followUp.laterStart, followUp.laterEnd);
+        if (useRegionOfInterest) {
+            StageTrace::Scope crop("later region of interest");
+            return RegionOfInterestType::Crop(later, RegionOfInterestType::ComputeRegion(later, threshold, 4, 20));
+        }
+        return later;
+    };
+
+    // Load the baseline and the first follow-up at the same time, splitting the decode threads between them
+    std::future<ImagePointer> nextMoving = std::async(std::launch::async, prepareFollowUp, 0);
+    ImagePointer baseline = loadSeries(job.baselineFormat, job.baselineStart, job.baselineEnd);
+    typename ImageType::RegionType fixedRegion = baseline->GetLargestPossibleRegion();
+    ImagePointer fixedInput = baseline;
+    if (useRegionOfInterest) {
+        StageTrace::Scope crop("baseline region of interest");
+        fixedRegion = RegionOfInterestType::ComputeRegion(baseline, threshold, 4, 10);
+        fixedInput = RegionOfInterestType::Crop(baseline, fixedRegion);
+        if (options.lowMemory) {
+            // Pasting the result back only needs the full baseline's geometry
+            ImagePointer geometry = ImageType::New();
+            geometry->CopyInformation(baseline);
+            baseline = geometry;
+        }
+    }
 
-        NonlinearRegisterOrganFilter<ImageType, OutputImageType>::Pointer nonlinearReg = NonlinearRegisterOrganFilter<ImageType, OutputImageType>::New();
-        nonlinearReg->SetFixedImage(baselineReader->GetOutput());
+    // Bring the baseline fully up to date before any stage runs, then give
+    // every stage that reads it its own graft: the pixels are shared, but
+    // each pipeline negotiates its requested region on its own data object,
+    // so stages running at the same time never update or resize the same one
+    fixedInput->Update();
+    auto graftBaseline = [&fixedInput]() -> ImagePointer {
+        ImagePointer branch = ImageType::New();
+        branch->Graft(fixedInput);
+        return branch;
+    };
+
+    // The filters are built once and kept across follow-ups, so everything
+    // that depends only on the baseline is computed on the first pass
+    typename RegistrationFilterType::Pointer reg = RegistrationFilterType::New();
+    reg->SetFixedImage(graftBaseline());
+    if (options.usePyramid) {
+        // Most iterations run on the coarsest volumes
+        reg->ClearPyramidLevels();
+        reg->AddPyramidLevel(8, 300, 0.2, 0.02);
+        reg->AddPyramidLevel(4, 150, 0.1, 0.01);
+        reg->AddPyramidLevel(2, 50, 0.05, 0.005);
+    }
+    reg->SetUseRecursiveGaussian(options.useRecursiveGaussian);
+    reg->SetSimilarityMetric(options.similarityMetric);
+    reg->SetNumberOfStarts(options.affineStarts);
+    reg->SetCacheDirectory(options.registrationCacheDirectory);
+    reg->SetReleaseIntermediateData(options.lowMemory);
+
+    typename NonlinearFilterType::Pointer nonlinearReg = NonlinearFilterType::New();
+    nonlinearReg->SetFixedImage(graftBaseline());
+    if (options.composeTransforms) {
+        // Only the affine parameters are needed; the later image is resampled once at the end
+        reg->ResampleMovingImageOff();
+        nonlinearReg->SetInitialTransformInput(reg->GetTransformOutput());
+    }
+    else {
         nonlinearReg->SetMovingImage(reg->GetOutput());
-        std::cout << "start nonlinear update" << std::endl;
-        nonlinearReg->Update();
-        std::cout << "nonlinear update done, start masking" << std::endl;
-
-        // Segment the lungs in both images
-        SegmentLungVolume<ImageType, ImageType>::Pointer segBaseline = SegmentLungVolume<ImageType, ImageType>::New();
-        segBaseline->SetInput(baselineReader->GetOutput());
-        segBaseline->SetThreshold(threshold);
-        segBaseline->SetVariance(variance);
-        segBaseline->Update();
-
-        SegmentLungVolume<ImageType, ImageType>::Pointer segLater = SegmentLungVolume<ImageType, ImageType>::New();
-        segLater->SetInput(nonlinearReg->GetOutput());
-        segLater->SetThreshold(threshold);
-        segLater->SetVariance(variance);
-        segLater->Update();
-
-        // Mask lungs in each image
-        itk::MaskImageFilter<ImageType, ImageType, ImageType>::Pointer maskBaseline = itk::MaskImageFilter<ImageType, ImageType, ImageType>::New();
-        maskBaseline->SetMaskImage(segBaseline->GetOutput());
-        maskBaseline->SetInput(baselineReader->GetOutput());
-        maskBaseline->SetMaskingValue(0);
-        maskBaseline->Update();
-
-        // Mask lungs in each image
-        itk::MaskImageFilter<ImageType, ImageType, ImageType>::Pointer maskLater = itk::MaskImageFilter<ImageType, ImageType, ImageType>::New();
-        maskLater->SetMaskImage(segLater->GetOutput());
-        maskLater->SetInput(nonlinearReg->GetOutput());
-        maskLater->SetMaskingValue(0);
-        maskLater->Update();
-
-        itk::SubtractImageFilter<ImageType, ImageType>::Pointer subtract = itk::SubtractImageFilter<ImageType, ImageType>::New();
-        subtract->SetInput1(maskBaseline->GetOutput());
-        subtract->SetInput2(maskLater->GetOutput());
-        subtract->Update();
-
-        // Generate output file paths
-        // TODO: Can clean up if sticking with 3D output images
-        nameGenerator->SetSeriesFormat(argv[7]);
-        nameGenerator->SetStartIndex(1);
-        //nameGenerator->SetEndIndex(std::stoi(argv[3]));
-        nameGenerator->SetEndIndex(1);
-        nameGenerator->SetIncrementIndex(1);
-        filePaths = nameGenerator->GetFileNames();
+
+        // Demons is the only reader of the affine result. Streamed, every
+        // slab asks for the whole affine output again, so it has to stay
+        // buffered or the affine resample and the Demons estimate rerun per
+        // slab; it is released by hand once the change map is done.
+        reg->SetReleaseDataFlag(options.lowMemory && options.streamSlabs <= 1);
+    }
+    nonlinearReg->SetCacheDirectory(options.registrationCacheDirectory);
+    nonlinearReg->SetReleaseIntermediateData(options.lowMemory);
+    nonlinearReg->SetUseFastIntensityMatching(options.useFastMatching);
+    if (options.useDemonsSchedule) {
+        // Iteration counts are caps; levels usually stop well before them
+        nonlinearReg->ClearDemonsLevels();
+        nonlinearReg->AddDemonsLevel(8, 2, 200);
+        nonlinearReg->AddDemonsLevel(4, 1, 150);
+        nonlinearReg->SetMetricTolerance(1e-3);
+        nonlinearReg->SetPlateauIterations(10);
+        nonlinearReg->SetMaximumRMSError(0.01);
+    }
+
+    // Segment the lungs in both images
+    typename SegmentFilterType::Pointer segBaseline = SegmentFilterType::New();
+    segBaseline->SetInput(graftBaseline());
+    segBaseline->SetThreshold(threshold);
+    segBaseline->SetVariance(variance);
+    segBaseline->SetUseFastMorphology(options.useFastMorphology);
+    segBaseline->SetUseRecursiveGaussian(options.useRecursiveGaussian);
+    segBaseline->SetReleaseIntermediateData(options.lowMemory);
+
+    typename SegmentFilterType::Pointer segLater = SegmentFilterType::New();
+    segLater->SetInput(nonlinearReg->GetOutput());
+    segLater->SetThreshold(threshold);
+    segLater->SetVariance(variance);
+    segLater->SetUseFastMorphology(options.useFastMorphology);
+    segLater->SetUseRecursiveGaussian(options.useRecursiveGaussian);
+    segLater->SetReleaseIntermediateData(options.lowMemory);
+
+    // Mask lungs in each image and subtract in one pass
+    typedef MaskedDifferenceImageFilter<ImageType, MaskImageType, ImageType> DifferenceFilterType;
+    typename DifferenceFilterType::Pointer difference = DifferenceFilterType::New();
+    difference->SetBaselineImage(graftBaseline());
+    difference->SetLaterImage(nonlinearReg->GetOutput());
+    difference->SetBaselineMask(segBaseline->GetOutput());
+    difference->SetLaterMask(segLater->GetOutput());
+    difference->SetComputeStatistics(options.writeStatistics);
+
+    // Optionally pull the change map through in slabs along z; the
+    // registration is still estimated once, on the first slab. The writer
+    // drives the slabs, so no stage holds the whole change map, and a
+    // region of interest is padded back to the baseline's extent slab by
+    // slab instead of pasted into a full-size copy.
+    const bool streamed = options.streamSlabs > 1;
+    typedef itk::ConstantPadImageFilter<ImageType, ImageType> PadFilterType;
+    typename PadFilterType::Pointer pad = PadFilterType::New();
+    pad->SetInput(difference->GetOutput());
+    if (useRegionOfInterest) {
+        const typename ImageType::RegionType full = baseline->GetLargestPossibleRegion();
+        typename ImageType::SizeType lower;
+        typename ImageType::SizeType upper;
+        for (unsigned int d = 0; d < ImageType::ImageDimension; d++) {
+            lower[d] = fixedRegion.GetIndex(d) - full.GetIndex(d);
+            upper[d] = full.GetUpperIndex()[d] - fixedRegion.GetUpperIndex()[d];
+        }
+        pad->SetPadLowerBound(lower);
+        pad->SetPadUpperBound(upper);
+        pad->SetConstant(itk::NumericTraits<typename ImageType::PixelType>::ZeroValue());
+    }
+    typedef itk::ImageFileWriter<ImageType> StreamWriterType;
+    typename StreamWriterType::Pointer streamWriter = StreamWriterType::New();
+    streamWriter->SetInput(useRegionOfInterest ? pad->GetOutput() : difference->GetOutput());
+    streamWriter->SetNumberOfStreamDivisions(options.streamSlabs);
+
+    // Sparse change maps are compressed from a whole volume, so the slabs are collected
+    typedef itk::StreamingImageFilter<ImageType, ImageType> StreamerType;
+    typename StreamerType::Pointer streamer = StreamerType::New();
+    streamer->SetInput(difference->GetOutput());
+    streamer->SetNumberOfStreamDivisions(options.streamSlabs);
+
+    typename WriterType::Pointer writer = WriterType::New();
+
+    // In low-memory mode the next follow-up is loaded only when it is needed
+    const std::launch prefetch = options.lowMemory ? std::launch::deferred : std::launch::async;
+    for (size_t index = 0; index < job.followUps.size(); index++) {
+        ImagePointer movingInput = nextMoving.get();
+        if (index + 1 < job.followUps.size()) {
+            nextMoving = std::async(prefetch, prepareFollowUp, index + 1);
+        }
+        reg->SetMovingImage(movingInput);
+        if (options.composeTransforms) {
+            nonlinearReg->SetMovingImage(movingInput);
+        }
 
         // Write output image
-        writer->SetFileNames(filePaths);
-        writer->SetInput(subtract->GetOutput());
-        std::cout << "writer set up" << std::endl;
-        writer->Update();
+        // TODO: Can clean up if sticking with 3D output images
+        const std::vector<std::string> outputFiles = GenerateFileNames(job.followUps[index].outputFormat, 1, 1);
+        writer->SetFileNames(outputFiles);
+        writer->SetInput(difference->GetOutput());
+
+        // Run the stages by their data dependencies. Baseline segmentation
+        // only needs the baseline volume, so it overlaps with registration,
+        // and is up to date after the first follow-up.
+        TaskGraph stages(threadBudget);
+        TaskGraph::TaskId affineStage = stages.AddTask("affine registration", [&reg](unsigned int threads) {
+            reg->SetNumberOfThreads(threads);
+            reg->Update();
+            StageTrace::Instance().Buffer("affine output", BufferBytes(reg->GetOutput()));
+        });
+        TaskGraph::TaskId baselineSegmentStage = stages.AddTask("baseline segmentation", [&segBaseline](unsigned int threads) {
+            segBaseline->SetNumberOfThreads(threads);
+            segBaseline->Update();
+            StageTrace::Instance().Buffer("baseline mask", BufferBytes(segBaseline->GetOutput()));
+        });
+        TaskGraph::TaskId differenceStage;
+        if (streamed) {
+            // Demons, the later segmentation and the difference run under one
+            // stage, since each slab passes through all of them
+            differenceStage = stages.AddTask("streamed change map", [&](unsigned int threads) {
+                nonlinearReg->SetNumberOfThreads(threads);
+                segLater->SetNumberOfThreads(threads);
+                difference->SetNumberOfThreads(threads);
+                pad->SetNumberOfThreads(threads);
+                if (options.sparseOutput) {
+                    streamer->Update();
+                }
+                else {
+                    streamWriter->SetFileName(outputFiles[0]);
+                    streamWriter->Update();
+                }
+                StageTrace::Instance().Buffer("difference", BufferBytes(difference->GetOutput()));
+                if (options.lowMemory) {
+                    // Every slab is written; nothing reads the estimate or the affine output again
+                    nonlinearReg->ReleaseEstimate();
+                    reg->GetOutput()->ReleaseData();
+                }
+            }, { affineStage, baselineSegmentStage });
+        }
+        else {
+            TaskGraph::TaskId nonlinearStage = stages.AddTask("nonlinear registration", [&](unsigned int threads) {
+                nonlinearReg->SetNumberOfThreads(threads);
+                nonlinearReg->Update();
+                StageTrace::Instance().Buffer("nonlinear output", BufferBytes(nonlinearReg->GetOutput()));
+                if (options.lowMemory) {
+                    // The whole output is warped, so the field is no longer needed
+                    nonlinearReg->ReleaseEstimate();
+                }
+            }, { affineStage });
+            TaskGraph::TaskId laterSegmentStage = stages.AddTask("later segmentation", [&segLater](unsigned int threads) {
+                segLater->SetNumberOfThreads(threads);
+                segLater->Update();
+                StageTrace::Instance().Buffer("later mask", BufferBytes(segLater->GetOutput()));
+            }, { nonlinearStage });
+            differenceStage = stages.AddTask("masked difference", [&](unsigned int threads) {
+                difference->SetNumberOfThreads(threads);
+                difference->Update();
+                StageTrace::Instance().Buffer("difference", BufferBytes(difference->GetOutput()));
+                if (options.lowMemory) {
+                    // Nothing else reads the registered later image or its mask
+                    nonlinearReg->GetOutput()->ReleaseData();
+                    segLater->GetOutput()->ReleaseData();
+                }
+            }, { nonlinearStage, baselineSegmentStage, laterSegmentStage });
+        }
+        if (!streamed || options.sparseOutput) {
+            stages.AddTask("write", [&](unsigned int threads) {
+                ImagePointer changeMap = streamed ? streamer->GetOutput() : difference->GetOutput();
+                if (useRegionOfInterest) {
+                    changeMap = RegionOfInterestType::Paste(changeMap, baseline, fixedRegion);
+                }
+                if (options.sparseOutput) {
+                    SparseChangeMap<ImageType>::Write(changeMap, outputFiles[0], threads);
+                    return;
+                }
+                writer->SetInput(changeMap);
+                writer->Update();
+            }, { differenceStage });
+        }
+        if (options.writeStatistics) {
+            stages.AddTask("statistics", [&](unsigned int) {
+                // Slices are numbered in the full baseline volume
+                const std::string statisticsFile = StatisticsFileName(outputFiles[0]);
+                if (!difference->WriteStatistics(statisticsFile, fixedRegion.GetIndex(ImageType::ImageDimension - 1))) {
+                    throw std::runtime_error("Could not write " + statisticsFile);
+                }
+            }, { differenceStage });
+        }
+        stages.Run();
+
+        if (options.lowMemory) {
+            // Drop this follow-up's volumes before the next one is loaded
+            difference->GetOutput()->ReleaseData();
+            streamer->GetOutput()->ReleaseData();
+            reg->SetMovingImage(ITK_NULLPTR);
+            if (options.composeTransforms) {
+                nonlinearReg->SetMovingImage(ITK_NULLPTR);
+            }
+        }
+    }
+}
+
+// Run every pair in the manifest on a pool of workers. Each worker gets an
+// equal share of the thread budget; a failed pair is reported and skipped.
+template <typename ImageType>
+int RunBatch(const PipelineOptions& options, VolumeCache<ImageType> *cache) {
+    std::vector<PairJob> jobs;
+    try {
+        jobs = ReadManifest(options.manifest);
+    }
+    catch (std::exception &e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+
+    const unsigned int workerCount = std::max(1u, std::min<unsigned int>(options.jobs, static_cast<unsigned int>(jobs.size())));
+    PipelineOptions jobOptions = options;
+    jobOptions.threadBudget = std::max(1u, options.threadBudget / workerCount);
+
+    // Without an explicit per-job limit, pairs share the process memory budget
+    const double jobMemoryLimitMB = options.maximumJobMemoryMB > 0 ? options.maximumJobMemoryMB : options.memoryBudgetMB / workerCount;
+
+    std::atomic<size_t> nextJob(0);
+    std::atomic<unsigned int> failures(0);
+    std::mutex reportMutex;
+    auto worker = [&]() {
+        for (size_t index = nextJob++; index < jobs.size(); index = nextJob++) {
+            const PairJob& job = jobs[index];
+            std::string error;
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            StageTrace::Label pair("pair " + std::to_string(index + 1));
+            try {
+                if (jobMemoryLimitMB > 0) {
+                    const double estimate = EstimatePairMemoryMB(job, sizeof(typename ImageType::PixelType), options.lowMemory);
+                    if (estimate > jobMemoryLimitMB) {
+                        throw std::runtime_error("estimated " + std::to_string(static_cast<long long>(estimate)) + " MB exceeds the per-job limit");
+                    }
+                }
+                RunPair(job, jobOptions, cache);
+            }
+            catch (itk::ExceptionObject &e) {
+                error = e.GetDescription();
+            }
+            catch (std::exception &e) {
+                error = e.what();
+            }
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> lock(reportMutex);
+            if (error.empty()) {
+                std::cout << "Pair " << index + 1 << "/" << jobs.size() << " " << job.followUps[0].outputFormat << ": done in " << seconds << " s" << std::endl;
+            }
+            else {
+                failures++;
+                std::cout << "Pair " << index + 1 << "/" << jobs.size() << " " << job.followUps[0].outputFormat << ": FAILED: " << error << std::endl;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < workerCount; i++) {
+        workers.push_back(std::thread(worker));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    std::cout << jobs.size() - failures << " of " << jobs.size() << " pairs completed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
+
+// Run the positional pair and its follow-ups, or the batch manifest, with
+// every full-resolution image in ImageType
+template <typename ImageType>
+int Run(const PairJob& job, const PipelineOptions& options) {
+    // Mapped volumes stay valid for as long as the cache exists
+    std::unique_ptr<VolumeCache<ImageType> > cache;
+    if (!options.cacheDirectory.empty()) {
+        cache.reset(new VolumeCache<ImageType>(options.cacheDirectory));
+    }
+
+    if (!options.manifest.empty()) {
+        return RunBatch(options, cache.get());
+    }
+
+    try {
+        RunPair(job, options, cache.get());
     }
     catch (itk::ExceptionObject e) {
         std::cout << e.GetDescription() << std::endl;
+        return 1;
+    }
+    catch (std::exception &e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Report the process's peak resident memory against the budget. Returns
+// false if the budget was exceeded.
+bool CheckMemoryBudget(const PipelineOptions& options) {
+    if (options.memoryBudgetMB <= 0) {
+        return true;
+    }
+    const double peakMB = StageTrace::PeakResidentBytes() / (1024.0 * 1024.0);
+    if (peakMB <= 0) {
+        std::cout << "Peak resident memory is not available on this platform" << std::endl;
+        return true;
+    }
+    const bool withinBudget = peakMB <= options.memoryBudgetMB;
+    std::cout << "Peak resident memory: " << static_cast<long long>(peakMB) << " MB of a " << static_cast<long long>(options.memoryBudgetMB)
+              << " MB budget" << (withinBudget ? "" : " (EXCEEDED)") << std::endl;
+    return withinBudget;
+}
+
+// Write whatever stage tracing was asked for
+void WriteTrace(const PipelineOptions& options) {
+    if (!options.traceFile.empty() && !StageTrace::Instance().WriteChromeTrace(options.traceFile)) {
+        std::cout << "Could not write trace " << options.traceFile << std::endl;
+    }
+    if (options.traceSummary) {
+        StageTrace::Instance().WriteSummary(std::cout);
+    }
+}
+
+}
+
+int main(int argc, char **argv) {
+    PipelineOptions options;
+    const bool batch = argc >= 3 && std::string(argv[1]) == "--batch";
+
+    // Accept input or display usage message
+    if (!batch && argc < 8) {
+        PrintUsage();
+        return 1;
+    }
+
+    // Parse optional flags after the positional arguments
+    if (batch) {
+        options.manifest = argv[2];
+    }
+    if (!ParseOptions(argc, argv, batch ? 3 : 8, options)) {
+        return 1;
+    }
+    if (batch && !options.followUps.empty()) {
+        std::cout << "--followup does not apply to --batch; give each follow-up its own manifest line" << std::endl;
+        return 1;
+    }
+    StageTrace::Instance().SetEnabled(!options.traceFile.empty() || options.traceSummary);
+
+    PairJob job;
+    if (!batch) {
+        job.baselineFormat = argv[1];
+        job.baselineStart = std::stoi(argv[2]);
+        job.baselineEnd = std::stoi(argv[3]);
+        FollowUp followUp;
+        followUp.laterFormat = argv[4];
+        followUp.laterStart = std::stoi(argv[5]);
+        followUp.laterEnd = std::stoi(argv[6]);
+        followUp.outputFormat = argv[7];
+        job.followUps.push_back(followUp);
+        job.followUps.insert(job.followUps.end(), options.followUps.begin(), options.followUps.end());
+    }
+
+    int status = options.useInt16 ? Run<ShortImageType>(job, options) : Run<FloatImageType>(job, options);
+    WriteTrace(options);
+    if (!CheckMemoryBudget(options) && status == 0) {
+        status = 1;
     }
 
-	return 0;
+	return status;
 }
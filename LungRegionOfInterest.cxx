@@ -0,0 +1,115 @@
+#include "LungRegionOfInterest.h"
+#include <algorithm>
+#include <set>
+#include <itkShrinkImageFilter.h>
+#include <itkConnectedComponentImageFilter.h>
+#include <itkImageRegionConstIteratorWithIndex.h>
+#include <itkRegionOfInterestImageFilter.h>
+#include <itkImageAlgorithm.h>
+#include "SegmentLungVolume.h"
+
+template <typename TImage>
+typename LungRegionOfInterest<TImage>::RegionType
+LungRegionOfInterest<TImage>::ComputeRegion(const ImageType *image, int threshold, unsigned int shrinkFactor, unsigned int padding) {
+    const unsigned int dimension = ImageType::ImageDimension;
+    typedef itk::Image<unsigned char, ImageType::ImageDimension> MaskImageType;
+    typedef itk::Image<unsigned int, ImageType::ImageDimension> LabelImageType;
+    const RegionType largest = image->GetLargestPossibleRegion();
+
+    // Coarse segmentation
+    typedef itk::ShrinkImageFilter<ImageType, ImageType> DownsampleType;
+    typename DownsampleType::Pointer downsample = DownsampleType::New();
+    downsample->SetInput(image);
+    for (unsigned int d = 0; d < dimension; d++) {
+        downsample->SetShrinkFactor(d, std::max(1u, std::min<unsigned int>(shrinkFactor, largest.GetSize()[d])));
+    }
+
+    typedef SegmentLungVolume<ImageType, MaskImageType> SegmentType;
+    typename SegmentType::Pointer segment = SegmentType::New();
+    segment->SetInput(downsample->GetOutput());
+    segment->SetThreshold(threshold);
+    segment->SetVariance(2.0);
+
+    typedef itk::ConnectedComponentImageFilter<MaskImageType, LabelImageType> ComponentType;
+    typename ComponentType::Pointer components = ComponentType::New();
+    components->SetInput(segment->GetOutput());
+    components->Update();
+    const LabelImageType *labels = components->GetOutput();
+    const RegionType coarse = labels->GetLargestPossibleRegion();
+
+    // Drop components touching the in-plane border
+    std::set<unsigned int> outside;
+    itk::ImageRegionConstIteratorWithIndex<LabelImageType> it(labels, coarse);
+    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+        const typename LabelImageType::IndexType index = it.GetIndex();
+        for (unsigned int d = 0; d < dimension - 1; d++) {
+            if (index[d] == coarse.GetIndex()[d] || index[d] == coarse.GetUpperIndex()[d]) {
+                outside.insert(it.Get());
+            }
+        }
+    }
+
+    // Bounding box of what is left
+    typename ImageType::IndexType lower = coarse.GetUpperIndex();
+    typename ImageType::IndexType upper = coarse.GetIndex();
+    bool found = false;
+    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+        if (it.Get() == 0 || outside.count(it.Get())) {
+            continue;
+        }
+        found = true;
+        for (unsigned int d = 0; d < dimension; d++) {
+            lower[d] = std::min(lower[d], it.GetIndex()[d]);
+            upper[d] = std::max(upper[d], it.GetIndex()[d]);
+        }
+    }
+    if (!found) {
+        return largest;
+    }
+
+    // Map the corners back to full resolution through physical space, then pad
+    typename ImageType::PointType lowerPoint;
+    typename ImageType::PointType upperPoint;
+    labels->TransformIndexToPhysicalPoint(lower, lowerPoint);
+    labels->TransformIndexToPhysicalPoint(upper, upperPoint);
+    typename ImageType::IndexType fullLower;
+    typename ImageType::IndexType fullUpper;
+    image->TransformPhysicalPointToIndex(lowerPoint, fullLower);
+    image->TransformPhysicalPointToIndex(upperPoint, fullUpper);
+
+    RegionType region;
+    for (unsigned int d = 0; d < dimension; d++) {
+        const long margin = padding + downsample->GetShrinkFactors()[d];
+        const long first = std::min(fullLower[d], fullUpper[d]) - margin;
+        const long last = std::max(fullLower[d], fullUpper[d]) + margin;
+        region.SetIndex(d, first);
+        region.SetSize(d, last - first + 1);
+    }
+    region.Crop(largest);
+    return region;
+}
+
+template <typename TImage>
+typename LungRegionOfInterest<TImage>::ImagePointer
+LungRegionOfInterest<TImage>::Crop(const ImageType *image, const RegionType &region) {
+    typedef itk::RegionOfInterestImageFilter<ImageType, ImageType> CropFilterType;
+    typename CropFilterType::Pointer crop = CropFilterType::New();
+    crop->SetInput(image);
+    crop->SetRegionOfInterest(region);
+    crop->Update();
+    ImagePointer cropped = crop->GetOutput();
+    cropped->DisconnectPipeline();
+    return cropped;
+}
+
+template <typename TImage>
+typename LungRegionOfInterest<TImage>::ImagePointer
+LungRegionOfInterest<TImage>::Paste(const ImageType *cropped, const ImageType *reference, const RegionType &region) {
+    ImagePointer full = ImageType::New();
+    full->CopyInformation(reference);
+    full->SetRegions(reference->GetLargestPossibleRegion());
+    full->Allocate();
+    full->FillBuffer(itk::NumericTraits<typename ImageType::PixelType>::ZeroValue());
+    itk::ImageAlgorithm::Copy(cropped, full.GetPointer(), cropped->GetLargestPossibleRegion(), region);
+    return full;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <itkImage.h>
+#include <itkImageRegion.h>
+
+// Restricts processing to the lungs. The region is a padded bounding box of a
+// coarse lung segmentation; images are cropped to it and the final result is
+// pasted back into a full-size image.
+template <typename TImage>
+class LungRegionOfInterest
+{
+public:
+    typedef TImage ImageType;
+    typedef typename ImageType::Pointer ImagePointer;
+    typedef typename ImageType::RegionType RegionType;
+
+    // Bounding box of the dark regions that do not touch the in-plane border
+    // (air outside the body does), grown by padding voxels on every side.
+    // Returns the whole image when nothing is found.
+    static RegionType ComputeRegion(const ImageType *image, int threshold, unsigned int shrinkFactor, unsigned int padding);
+
+    // Copy of the region that keeps its physical position
+    static ImagePointer Crop(const ImageType *image, const RegionType &region);
+
+    // Full-size image with the geometry of reference, zero outside the cropped result
+    static ImagePointer Paste(const ImageType *cropped, const ImageType *reference, const RegionType &region);
+};
@@ -0,0 +1,309 @@
+#include "MaskedDifferenceImageFilter.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::MaskedDifferenceImageFilter()
+{
+    this->SetNumberOfRequiredInputs(4);
+    m_ComputeStatistics = false;
+    m_HistogramMinimum = -2000.0;
+    m_HistogramMaximum = 2000.0;
+    m_NumberOfHistogramBins = 400;
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::~MaskedDifferenceImageFilter()
+{
+    //
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+void MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::ResetStatistics(Statistics &statistics) const {
+    const SliceStatistics emptySlice = { 0, 0, 0, 0.0 };
+    statistics.baselineVoxels = 0;
+    statistics.laterVoxels = 0;
+    statistics.baselineSum = 0;
+    statistics.laterSum = 0;
+    statistics.differenceVoxels = 0;
+    statistics.differenceSum = 0;
+    statistics.differenceSumOfSquares = 0;
+    statistics.differenceMinimum = std::numeric_limits<double>::max();
+    statistics.differenceMaximum = -std::numeric_limits<double>::max();
+    statistics.histogram.assign(std::max(1u, m_NumberOfHistogramBins), 0);
+    statistics.slices.assign(this->GetOutput()->GetLargestPossibleRegion().GetSize(OutputImageType::ImageDimension - 1), emptySlice);
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+void MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::BeforeThreadedGenerateData() {
+    if (!m_ComputeStatistics) {
+        return;
+    }
+
+    // A region starting at the first slice begins a new update; streamed
+    // regions after it add to the same totals
+    const unsigned int last = OutputImageType::ImageDimension - 1;
+    const OutputImageRegionType &requested = this->GetOutput()->GetRequestedRegion();
+    if (requested.GetIndex(last) == this->GetOutput()->GetLargestPossibleRegion().GetIndex(last)) {
+        ResetStatistics(m_Statistics);
+    }
+    m_ThreadStatistics.resize(this->GetNumberOfThreads());
+    for (size_t i = 0; i < m_ThreadStatistics.size(); i++) {
+        ResetStatistics(m_ThreadStatistics[i]);
+    }
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+void MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::AfterThreadedGenerateData() {
+    if (!m_ComputeStatistics) {
+        return;
+    }
+    Statistics &total = m_Statistics;
+    for (size_t i = 0; i < m_ThreadStatistics.size(); i++) {
+        const Statistics &part = m_ThreadStatistics[i];
+        total.baselineVoxels += part.baselineVoxels;
+        total.laterVoxels += part.laterVoxels;
+        total.baselineSum += part.baselineSum;
+        total.laterSum += part.laterSum;
+        total.differenceVoxels += part.differenceVoxels;
+        total.differenceSum += part.differenceSum;
+        total.differenceSumOfSquares += part.differenceSumOfSquares;
+        total.differenceMinimum = std::min(total.differenceMinimum, part.differenceMinimum);
+        total.differenceMaximum = std::max(total.differenceMaximum, part.differenceMaximum);
+        for (size_t bin = 0; bin < total.histogram.size(); bin++) {
+            total.histogram[bin] += part.histogram[bin];
+        }
+        for (size_t slice = 0; slice < total.slices.size(); slice++) {
+            total.slices[slice].baselineVoxels += part.slices[slice].baselineVoxels;
+            total.slices[slice].laterVoxels += part.slices[slice].laterVoxels;
+            total.slices[slice].differenceVoxels += part.slices[slice].differenceVoxels;
+            total.slices[slice].differenceSum += part.slices[slice].differenceSum;
+        }
+    }
+    m_ThreadStatistics.clear();
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+void MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::ThreadedGenerateData(const OutputImageRegionType &outputRegion, itk::ThreadIdType threadId) {
+    const ImageType *baseline = this->GetBaselineImage();
+    const ImageType *later = this->GetLaterImage();
+    const MaskImageType *baselineMask = this->GetBaselineMask();
+    const MaskImageType *laterMask = this->GetLaterMask();
+    OutputImageType *output = this->GetOutput();
+
+    const MaskPixelType maskingValue = itk::NumericTraits<MaskPixelType>::ZeroValue();
+    const AccumulateType zero = itk::NumericTraits<AccumulateType>::ZeroValue();
+    const size_t lineLength = outputRegion.GetSize()[0];
+
+    // Histogram bin of a difference d is floor((d - minimum) * binScale), clamped
+    const double lastBin = std::max(1u, m_NumberOfHistogramBins) - 1.0;
+    const double binScale = m_HistogramMaximum > m_HistogramMinimum ? (lastBin + 1.0) / (m_HistogramMaximum - m_HistogramMinimum) : 0.0;
+    const itk::IndexValueType firstSlice = output->GetLargestPossibleRegion().GetIndex(OutputImageType::ImageDimension - 1);
+
+    // Walk the region one scanline at a time. Within a line every buffer is
+    // contiguous, so the inner loop is plain selects and a subtract that the
+    // compiler can vectorize.
+    itk::ImageScanlineIterator<OutputImageType> it(output, outputRegion);
+    while (!it.IsAtEnd()) {
+        const typename OutputImageType::IndexType index = it.GetIndex();
+        const PixelType *baselineLine = baseline->GetBufferPointer() + baseline->ComputeOffset(index);
+        const PixelType *laterLine = later->GetBufferPointer() + later->ComputeOffset(index);
+        const MaskPixelType *baselineMaskLine = baselineMask->GetBufferPointer() + baselineMask->ComputeOffset(index);
+        const MaskPixelType *laterMaskLine = laterMask->GetBufferPointer() + laterMask->ComputeOffset(index);
+        OutputPixelType *outputLine = output->GetBufferPointer() + output->ComputeOffset(index);
+
+        for (size_t i = 0; i < lineLength; i++) {
+            const AccumulateType b = baselineMaskLine[i] != maskingValue ? static_cast<AccumulateType>(baselineLine[i]) : zero;
+            const AccumulateType l = laterMaskLine[i] != maskingValue ? static_cast<AccumulateType>(laterLine[i]) : zero;
+            outputLine[i] = static_cast<OutputPixelType>(b - l);
+        }
+        if (m_ComputeStatistics) {
+            // A second sweep over the same line while it is still in cache,
+            // so the subtraction above stays vectorizable
+            Statistics &statistics = m_ThreadStatistics[threadId];
+            SliceStatistics line = { 0, 0, 0, 0.0 };
+            double baselineSum = 0;
+            double laterSum = 0;
+            double sumOfSquares = 0;
+            double minimum = statistics.differenceMinimum;
+            double maximum = statistics.differenceMaximum;
+            for (size_t i = 0; i < lineLength; i++) {
+                const bool inBaseline = baselineMaskLine[i] != maskingValue;
+                const bool inLater = laterMaskLine[i] != maskingValue;
+                if (!inBaseline && !inLater) {
+                    continue;
+                }
+                if (inBaseline) {
+                    line.baselineVoxels++;
+                    baselineSum += baselineLine[i];
+                }
+                if (inLater) {
+                    line.laterVoxels++;
+                    laterSum += laterLine[i];
+                }
+
+                // Density change only where both timepoints have lung; a voxel
+                // in one mask only holds a raw intensity, not a change
+                if (!inBaseline || !inLater) {
+                    continue;
+                }
+                const double difference = outputLine[i];
+                line.differenceVoxels++;
+                line.differenceSum += difference;
+                sumOfSquares += difference * difference;
+                minimum = std::min(minimum, difference);
+                maximum = std::max(maximum, difference);
+                const double bin = std::floor((difference - m_HistogramMinimum) * binScale);
+                statistics.histogram[static_cast<size_t>(std::min(std::max(bin, 0.0), lastBin))]++;
+            }
+            statistics.baselineVoxels += line.baselineVoxels;
+            statistics.laterVoxels += line.laterVoxels;
+            statistics.baselineSum += baselineSum;
+            statistics.laterSum += laterSum;
+            statistics.differenceVoxels += line.differenceVoxels;
+            statistics.differenceSum += line.differenceSum;
+            statistics.differenceSumOfSquares += sumOfSquares;
+            statistics.differenceMinimum = minimum;
+            statistics.differenceMaximum = maximum;
+
+            SliceStatistics &slice = statistics.slices[index[OutputImageType::ImageDimension - 1] - firstSlice];
+            slice.baselineVoxels += line.baselineVoxels;
+            slice.laterVoxels += line.laterVoxels;
+            slice.differenceVoxels += line.differenceVoxels;
+            slice.differenceSum += line.differenceSum;
+        }
+        it.NextLine();
+    }
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+void MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::SetBaselineImage(const ImageType *image) {
+    this->ProcessObject::SetNthInput(0, const_cast<ImageType*>(image));
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+void MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::SetLaterImage(const ImageType *image) {
+    this->ProcessObject::SetNthInput(1, const_cast<ImageType*>(image));
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+void MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::SetBaselineMask(const MaskImageType *mask) {
+    this->ProcessObject::SetNthInput(2, const_cast<MaskImageType*>(mask));
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+void MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::SetLaterMask(const MaskImageType *mask) {
+    this->ProcessObject::SetNthInput(3, const_cast<MaskImageType*>(mask));
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+const TInputImage *
+MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::GetBaselineImage() {
+    return static_cast<const ImageType*>(this->ProcessObject::GetInput(0));
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+const TInputImage *
+MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::GetLaterImage() {
+    return static_cast<const ImageType*>(this->ProcessObject::GetInput(1));
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+const TMaskImage *
+MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::GetBaselineMask() {
+    return static_cast<const MaskImageType*>(this->ProcessObject::GetInput(2));
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+const TMaskImage *
+MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::GetLaterMask() {
+    return static_cast<const MaskImageType*>(this->ProcessObject::GetInput(3));
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+double MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::GetDifferencePercentile(double fraction) const {
+    const std::vector<itk::SizeValueType> &histogram = m_Statistics.histogram;
+    if (m_Statistics.differenceVoxels == 0 || histogram.empty()) {
+        return 0.0;
+    }
+    const double binWidth = (m_HistogramMaximum - m_HistogramMinimum) / histogram.size();
+    const double target = std::min(std::max(fraction, 0.0), 1.0) * m_Statistics.differenceVoxels;
+    double below = 0;
+    for (size_t bin = 0; bin < histogram.size(); bin++) {
+        if (histogram[bin] > 0 && below + histogram[bin] >= target) {
+            const double value = m_HistogramMinimum + (bin + (target - below) / histogram[bin]) * binWidth;
+            return std::min(std::max(value, m_Statistics.differenceMinimum), m_Statistics.differenceMaximum);
+        }
+        below += histogram[bin];
+    }
+    return m_Statistics.differenceMaximum;
+}
+
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+bool MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage>::WriteStatistics(const std::string &fileName, itk::IndexValueType firstSlice) const {
+    std::ofstream out(fileName.c_str());
+    if (!out) {
+        return false;
+    }
+    const Statistics &statistics = m_Statistics;
+    const typename OutputImageType::SpacingType &spacing = this->GetOutput()->GetSpacing();
+    double voxelVolume = 1.0;
+    for (unsigned int d = 0; d < OutputImageType::ImageDimension; d++) {
+        voxelVolume *= spacing[d];
+    }
+
+    // Volumes in mL from mm^3 voxels
+    const double toMilliliters = voxelVolume / 1000.0;
+    const double count = static_cast<double>(std::max<itk::SizeValueType>(1, statistics.differenceVoxels));
+    const double mean = statistics.differenceSum / count;
+    const double variance = statistics.differenceVoxels > 1
+        ? std::max(0.0, (statistics.differenceSumOfSquares - statistics.differenceSum * mean) / (count - 1)) : 0.0;
+
+    out << std::fixed << std::setprecision(4);
+    out << "{\n";
+    out << "  \"voxelVolumeMm3\": " << voxelVolume << ",\n";
+    out << "  \"baseline\": {\"voxels\": " << statistics.baselineVoxels << ", \"volumeMl\": " << statistics.baselineVoxels * toMilliliters
+        << ", \"meanDensity\": " << statistics.baselineSum / std::max<itk::SizeValueType>(1, statistics.baselineVoxels) << "},\n";
+    out << "  \"later\": {\"voxels\": " << statistics.laterVoxels << ", \"volumeMl\": " << statistics.laterVoxels * toMilliliters
+        << ", \"meanDensity\": " << statistics.laterSum / std::max<itk::SizeValueType>(1, statistics.laterVoxels) << "},\n";
+    out << "  \"overlapVoxels\": " << statistics.differenceVoxels << ",\n";
+    out << "  \"baselineOnlyVoxels\": " << statistics.baselineVoxels - statistics.differenceVoxels << ",\n";
+    out << "  \"laterOnlyVoxels\": " << statistics.laterVoxels - statistics.differenceVoxels << ",\n";
+    out << "  \"volumeChangeMl\": " << (static_cast<double>(statistics.laterVoxels) - statistics.baselineVoxels) * toMilliliters << ",\n";
+    out << "  \"difference\": {\"voxels\": " << statistics.differenceVoxels << ", \"mean\": " << mean
+        << ", \"standardDeviation\": " << std::sqrt(variance);
+    if (statistics.differenceVoxels > 0) {
+        out << ", \"minimum\": " << statistics.differenceMinimum << ", \"maximum\": " << statistics.differenceMaximum;
+    }
+    out << ",\n    \"percentiles\": {";
+    const int percentiles[] = { 5, 25, 50, 75, 95 };
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        out << (i > 0 ? ", " : "") << "\"" << percentiles[i] << "\": " << GetDifferencePercentile(percentiles[i] / 100.0);
+    }
+    out << "},\n";
+    out << "    \"histogram\": {\"minimum\": " << m_HistogramMinimum << ", \"maximum\": " << m_HistogramMaximum << ", \"counts\": [";
+    for (size_t bin = 0; bin < statistics.histogram.size(); bin++) {
+        out << (bin > 0 ? ", " : "") << statistics.histogram[bin];
+    }
+    out << "]}},\n";
+
+    // Only slices that have lung in either image; the mean difference is over the overlap
+    out << "  \"slices\": [";
+    bool first = true;
+    for (size_t slice = 0; slice < statistics.slices.size(); slice++) {
+        const SliceStatistics &summary = statistics.slices[slice];
+        if (summary.baselineVoxels == 0 && summary.laterVoxels == 0) {
+            continue;
+        }
+        out << (first ? "\n" : ",\n") << "    {\"slice\": " << firstSlice + static_cast<itk::IndexValueType>(slice)
+            << ", \"baselineVoxels\": " << summary.baselineVoxels << ", \"laterVoxels\": " << summary.laterVoxels
+            << ", \"overlapVoxels\": " << summary.differenceVoxels
+            << ", \"meanDifference\": " << summary.differenceSum / std::max<itk::SizeValueType>(1, summary.differenceVoxels) << "}";
+        first = false;
+    }
+    out << (first ? "]\n" : "\n  ]\n") << "}\n";
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <itkImage.h>
+#include <itkImageToImageFilter.h>
+#include <itkImageScanlineIterator.h>
+#include <itkNumericTraits.h>
+#include <string>
+#include <vector>
+
+// Masks the baseline and later images with their lung masks and subtracts
+// them in a single pass, replacing two MaskImageFilters and a
+// SubtractImageFilter. Output is (baseline where baselineMask != 0) minus
+// (later where laterMask != 0).
+// With ComputeStatistics on, the same pass also gathers mask volumes, the
+// mean density in each mask, the voxels in only one of the masks, and a
+// histogram and per-slice means of the difference over the overlap of the
+// masks, where it measures density change. Each thread fills its own
+// accumulators, which are summed after every region, so the statistics
+// cover the whole image when the output is streamed along z.
+template <typename TInputImage, typename TMaskImage, typename TOutputImage>
+class MaskedDifferenceImageFilter : public itk::ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+    typedef MaskedDifferenceImageFilter<TInputImage, TMaskImage, TOutputImage> Self;
+    typedef itk::ImageToImageFilter<TInputImage, TOutputImage> Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    typedef itk::SmartPointer<const Self> ConstPointer;
+    typedef TInputImage ImageType;
+    typedef TMaskImage MaskImageType;
+    typedef TOutputImage OutputImageType;
+    typedef typename ImageType::PixelType PixelType;
+    typedef typename MaskImageType::PixelType MaskPixelType;
+    typedef typename OutputImageType::PixelType OutputPixelType;
+    typedef typename OutputImageType::RegionType OutputImageRegionType;
+
+    itkNewMacro(Self);
+
+    // Gather statistics while subtracting; off by default
+    itkSetMacro(ComputeStatistics, bool);
+    itkGetMacro(ComputeStatistics, bool);
+    itkBooleanMacro(ComputeStatistics);
+
+    // Difference histogram range and bins; values outside go to the end bins
+    itkSetMacro(HistogramMinimum, double);
+    itkGetMacro(HistogramMinimum, double);
+    itkSetMacro(HistogramMaximum, double);
+    itkGetMacro(HistogramMaximum, double);
+    itkSetMacro(NumberOfHistogramBins, unsigned int);
+    itkGetMacro(NumberOfHistogramBins, unsigned int);
+
+    struct SliceStatistics {
+        itk::SizeValueType baselineVoxels;
+        itk::SizeValueType laterVoxels;
+        itk::SizeValueType differenceVoxels;
+        double differenceSum;
+    };
+
+    struct Statistics {
+        itk::SizeValueType baselineVoxels;
+        itk::SizeValueType laterVoxels;
+        double baselineSum;
+        double laterSum;
+
+        // Difference over voxels in both masks
+        itk::SizeValueType differenceVoxels;
+        double differenceSum;
+        double differenceSumOfSquares;
+        double differenceMinimum;
+        double differenceMaximum;
+        std::vector<itk::SizeValueType> histogram;
+
+        // One entry per slice of the largest possible region
+        std::vector<SliceStatistics> slices;
+    };
+
+    MaskedDifferenceImageFilter();
+    ~MaskedDifferenceImageFilter();
+    void SetBaselineImage(const ImageType *image);
+    void SetLaterImage(const ImageType *image);
+    void SetBaselineMask(const MaskImageType *mask);
+    void SetLaterMask(const MaskImageType *mask);
+    const ImageType* GetBaselineImage();
+    const ImageType* GetLaterImage();
+    const MaskImageType* GetBaselineMask();
+    const MaskImageType* GetLaterMask();
+
+    // Statistics of the last update, complete once its last region is written
+    const Statistics &GetStatistics() const { return m_Statistics; }
+
+    // Difference at the given fraction (0 to 1) of the histogram, interpolated within its bin
+    double GetDifferencePercentile(double fraction) const;
+
+    // Write the statistics as JSON. Slice numbers are offset by
+    // firstSlice, so a cropped volume reports the full image's slices.
+    bool WriteStatistics(const std::string &fileName, itk::IndexValueType firstSlice = 0) const;
+
+protected:
+    typedef typename itk::NumericTraits<OutputPixelType>::AccumulateType AccumulateType;
+
+    void BeforeThreadedGenerateData();
+    void ThreadedGenerateData(const OutputImageRegionType &outputRegion, itk::ThreadIdType threadId);
+    void AfterThreadedGenerateData();
+
+    // Empty statistics sized for the histogram and the output's slices
+    void ResetStatistics(Statistics &statistics) const;
+
+private:
+    bool m_ComputeStatistics;
+    double m_HistogramMinimum;
+    double m_HistogramMaximum;
+    unsigned int m_NumberOfHistogramBins;
+    Statistics m_Statistics;
+    std::vector<Statistics> m_ThreadStatistics;
+};
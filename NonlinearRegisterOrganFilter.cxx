@@ -1,65 +1,60 @@
 #include "NonlinearRegisterOrganFilter.h"
-#include "itkCommand.h"
+#include "IntensityMatching.cxx"
 
 using namespace std;
 
-class CommandIterationUpdate : public itk::Command
+template <typename TInputImage, typename TOutputImage>
+NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::NonlinearRegisterOrganFilter()
 {
-    public:
-    typedef  CommandIterationUpdate                     Self;
-    typedef  itk::Command                               Superclass;
-    typedef  itk::SmartPointer<CommandIterationUpdate>  Pointer;
-
-    itkNewMacro( CommandIterationUpdate );
-
-    protected:
-    CommandIterationUpdate() {};
-
-    typedef itk::Image<float, 3>            InternalImageType;
-    typedef itk::Vector<float, 3>           VectorPixelType;
-    typedef itk::Image<VectorPixelType, 3>  DisplacementFieldType;
-    typedef itk::DemonsRegistrationFilter<InternalImageType, InternalImageType, DisplacementFieldType>   RegistrationFilterType;
-
-    public:
+    transform = IdentityTransformType::New();
+    transform->SetIdentity();
+    observer = CommandIterationUpdate::New();
+    CreateInternalFilters();
 
-    void Execute(itk::Object *caller, const itk::EventObject & event) ITK_OVERRIDE
-    {
-        Execute((const itk::Object *)caller, event);
-    }
+    // Default schedule is a single level at 1/4 in-plane resolution
+    AddDemonsLevel(4, 1, 500);
 
-    void Execute(const itk::Object * object, const itk::EventObject & event) ITK_OVERRIDE
-    {
-        const RegistrationFilterType * filter = static_cast<const RegistrationFilterType *>(object);
-        if(!(itk::IterationEvent().CheckEvent(&event))) {
-            return;
-        }
-        std::cout <<  ": " << filter->GetMetric() << std::endl;
-    }
-};
+    // Convergence checks are off unless configured
+    m_MaximumRMSError = 0.0;
+    m_MetricTolerance = 0.0;
+    m_PlateauIterations = 10;
+    m_ReleaseIntermediateData = false;
+    m_UseFastIntensityMatching = false;
+    m_FixedLevelsSource = ITK_NULLPTR;
+    m_FixedLevelsTime = 0;
+}
 
 template <typename TInputImage, typename TOutputImage>
-NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::NonlinearRegisterOrganFilter()
+NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::~NonlinearRegisterOrganFilter()
 {
+    //
+}
+
+template <typename TInputImage, typename TOutputImage>
+void NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::CreateInternalFilters() {
     downsampleBaseline = DownsampleType::New();
     downsampleLater = DownsampleType::New();
     baselineNormalize = NormalizeType::New();
     laterNormalize = NormalizeType::New();
     matcher = MatchingFilterType::New();
     filter = RegistrationFilterType::New();
+    filter->AddObserver( itk::IterationEvent(), observer );
     warper = WarperType::New();
     interpolator = InterpolatorType::New();
-    transform = IdentityTransformType::New();
+    outputInterpolator = OutputInterpolatorType::New();
+    outputInterpolator->SetInterpolator(interpolator);
     resample = ResampleFilterType::New();
-}
-
-template <typename TInputImage, typename TOutputImage>
-NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::~NonlinearRegisterOrganFilter()
-{
-    //
+    movingResample = MovingResampleFilterType::New();
+    composedResample = ComposedResampleFilterType::New();
+    fieldCast = FieldCastFilterType::New();
+    coefficientFilter = CoefficientFilterType::New();
 }
 
 template <typename TInputImage, typename TOutputImage>
 void NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::GenerateData() {
+    // The initial transform, if any, is up to date with its input by now
+    m_InitialTransform = this->GetInitialTransform();
+
     // Graft fixed image input
     typename ImageType::Pointer fixed = ImageType::New();
     fixed->Graft(this->GetFixedImage());
@@ -68,90 +63,163 @@ void NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::GenerateData() {
     typename ImageType::Pointer moving = ImageType::New();
     moving->Graft(this->GetMovingImage());
 
-    cout << "Start downsample" << endl;
-    // Set up downsampling
-    downsampleBaseline->SetInput(fixed);
-    downsampleBaseline->SetShrinkFactor(0, 4);
-    downsampleBaseline->SetShrinkFactor(1, 4);
-    downsampleBaseline->SetShrinkFactor(2, 1);
+    // Internal filters share this filter's thread count
+    const itk::ThreadIdType threads = this->GetNumberOfThreads();
+    downsampleBaseline->SetNumberOfThreads(threads);
+    downsampleLater->SetNumberOfThreads(threads);
+    baselineNormalize->SetNumberOfThreads(threads);
+    laterNormalize->SetNumberOfThreads(threads);
+    matcher->SetNumberOfThreads(threads);
+    filter->SetNumberOfThreads(threads);
+    resample->SetNumberOfThreads(threads);
+    warper->SetNumberOfThreads(threads);
+    movingResample->SetNumberOfThreads(threads);
+    composedResample->SetNumberOfThreads(threads);
 
-    downsampleLater->SetInput(moving);
-    downsampleLater->SetShrinkFactor(0, 4);
-    downsampleLater->SetShrinkFactor(1, 4);
-    downsampleLater->SetShrinkFactor(2, 1);
+    // Intermediates with a single consumer; the matched moving level is
+    // freed once Demons has run on it
+    downsampleBaseline->SetReleaseDataFlag(m_ReleaseIntermediateData);
+    downsampleLater->SetReleaseDataFlag(m_ReleaseIntermediateData);
+    movingResample->SetReleaseDataFlag(m_ReleaseIntermediateData);
+    laterNormalize->SetReleaseDataFlag(m_ReleaseIntermediateData);
+    matcher->SetReleaseDataFlag(m_ReleaseIntermediateData);
+    resample->SetReleaseDataFlag(m_ReleaseIntermediateData);
 
-    cout << "downsample update" << endl;
-    downsampleBaseline->Update();
-    downsampleLater->Update();
-    cout << "downsample done, start norm" << endl;
+    // Estimate once; further output regions of the same update only warp
+    if (!EstimateIsCurrent()) {
+        m_Field = UpdateDisplacementField(fixed, moving);
 
-    // Set up normalize
-    baselineNormalize->SetInput(downsampleBaseline->GetOutput());
-    laterNormalize->SetInput(downsampleLater->GetOutput());
-    cout << "norm update" << endl;
-    baselineNormalize->Update();
-    laterNormalize->Update();
-    cout << "norm done, start matching" << endl;
+        // B-spline coefficients of the whole moving image, shared by every output region
+        StageTrace::Scope coefficients("demons spline coefficients");
+        coefficientFilter->SetSplineOrder(3);
+        coefficientFilter->SetInput(moving);
+        coefficientFilter->Update();
+        m_Coefficients = coefficientFilter->GetOutput();
+        m_Coefficients->DisconnectPipeline();
+        m_EstimateTime.Modified();
+    }
 
-    // Set up histogram matcher
-    matcher->SetInput( laterNormalize->GetOutput() );
-    matcher->SetReferenceImage( baselineNormalize->GetOutput() );
-    matcher->SetNumberOfHistogramLevels( 1024 );
-    matcher->SetNumberOfMatchPoints( 10000 );
-    matcher->ThresholdAtMeanIntensityOn();
+    // Set up B-Spline interpolator over the precomputed coefficients; integer
+    // outputs take its values rounded
+    interpolator->SetSplineOrder(3);
 
-    CommandIterationUpdate::Pointer observer = CommandIterationUpdate::New();
-    filter->AddObserver( itk::IterationEvent(), observer );
+    if (m_InitialTransform) {
+        // The displacement transform interpolates the coarse field directly, so
+        // no full resolution field is ever built
+        fieldCast->SetInput(m_Field);
+        fieldCast->Update();
+        typename DisplacementTransformType::Pointer displacement = DisplacementTransformType::New();
+        displacement->SetDisplacementField(fieldCast->GetOutput());
 
-    filter->SetFixedImage( baselineNormalize->GetOutput() );
-    filter->SetMovingImage( matcher->GetOutput() );
-    filter->SetNumberOfIterations( 500 );
-    filter->SetStandardDeviations( 12.0 );
-    cout << "update matching filter" << endl;
-    filter->UpdateLargestPossibleRegion();
-    cout << "matching filter done, start warp" << endl;
+        // The last transform added is applied first: x -> A(x + d(x))
+        typename CompositeTransformType::Pointer composite = CompositeTransformType::New();
+        composite->AddTransform(const_cast<TransformBaseType *>(m_InitialTransform.GetPointer()));
+        composite->AddTransform(displacement);
 
-    // Set up B-Spline interpolator
-    interpolator->SetSplineOrder(3);
+        // Resample the original moving image once on the fixed image's grid,
+        // padding like the affine stage does
+        composedResample->SetInput(m_Coefficients);
+        composedResample->SetTransform(composite);
+        composedResample->SetInterpolator(outputInterpolator);
+        composedResample->SetOutputParametersFromImage(fixed);
+        composedResample->SetDefaultPixelValue(100);
+        StageTrace::Scope composed("composed resample");
+        composedResample->GraftOutput(this->GetOutput());
+        composedResample->Update();
+        this->GraftOutput(composedResample->GetOutput());
+    }
+    else {
+        // Scale the warp vector field up to the fixed image's grid; the warper
+        // only pulls the part of it under the output region
+        resample->SetTransform(transform);
+        resample->SetInput(m_Field);
+        resample->SetOutputParametersFromImage(fixed);
 
-    // Set up the final resampler to scale up the warp vector field
-    const double origin[3]  = { 0.0, 0.0, 0.0 };
-    const ImageType::SizeType& size = fixed->GetLargestPossibleRegion().GetSize();
-    const ImageType::SpacingType& spacing = fixed->GetSpacing();
-    transform->SetIdentity();
-    resample->SetTransform(transform);
-    //resample->SetInterpolator(interpolator);
-    resample->SetOutputOrigin(origin);
-    resample->SetInput(filter->GetOutput());
- 
-    // Calculate new spacing
-    double outputSpacing[3];
-    outputSpacing[0] = spacing[0] * (double) size[0] / (double) 512;
-    outputSpacing[1] = spacing[1] * (double) size[1] / (double) 512;
-    outputSpacing[2] = spacing[2];
-    resample->SetOutputSpacing(outputSpacing);
-
-    // Set new size
-    itk::Size<3> outputSize = { {512, 512, size[2]} };
-    resample->SetSize(outputSize);
- 
-    resample->Update();
-
-    // Warp the moving image with the larger displacement field
-    warper->SetInput( moving );
-    warper->SetInterpolator( interpolator );
-    warper->SetOutputSpacing( moving->GetSpacing() );
-    warper->SetOutputOrigin( moving->GetOrigin() );
-    warper->SetOutputDirection( moving->GetDirection() );
-    warper->SetDisplacementField( resample->GetOutput() );
-
-    // Graft outputs at end of the pipeline
-    cout << "graft warp" << endl;
-    warper->GraftOutput(this->GetOutput());
-    cout << "update warp" << endl;
-    warper->UpdateLargestPossibleRegion();
-    cout << "warp updated, graft out" << endl;
-    this->GraftOutput(warper->GetOutput());
+        // Warp the moving image with the larger displacement field
+        warper->SetInput( m_Coefficients );
+        warper->SetInterpolator( outputInterpolator );
+        warper->SetOutputParametersFromImage( fixed );
+        warper->SetDisplacementField( resample->GetOutput() );
+
+        // Graft outputs at end of the pipeline
+        StageTrace::Scope warp("demons warp");
+        warper->GraftOutput(this->GetOutput());
+        warper->Update();
+        this->GraftOutput(warper->GetOutput());
+    }
+
+    if (m_ReleaseIntermediateData) {
+        CreateInternalFilters();
+    }
+}
+
+template <typename TInputImage, typename TOutputImage>
+void NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::ReleaseEstimate() {
+    m_Field = ITK_NULLPTR;
+    m_Coefficients = ITK_NULLPTR;
+}
+
+template <typename TInputImage, typename TOutputImage>
+typename NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::DisplacementFieldTypePointer
+NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::UpdateDisplacementField(ImageType *fixed, ImageType *moving) {
+    // Reuse a cached displacement field for identical inputs and settings
+    DisplacementFieldTypePointer field;
+    std::string cacheKey;
+    if (!m_CacheDirectory.empty()) {
+        RegistrationCache<ImageType> cache(m_CacheDirectory);
+        std::ostringstream settings;
+        settings << "demons|" << m_MaximumRMSError << ',' << m_MetricTolerance << ',' << m_PlateauIterations << ',' << m_UseFastIntensityMatching;
+        for (size_t level = 0; level < m_DemonsLevels.size(); level++) {
+            settings << '|' << m_DemonsLevels[level].inPlaneShrinkFactor << ',' << m_DemonsLevels[level].sliceShrinkFactor
+                     << ',' << m_DemonsLevels[level].iterations;
+        }
+        if (m_InitialTransform) {
+            settings << "|initial" << m_InitialTransform->GetParameters() << m_InitialTransform->GetFixedParameters();
+        }
+        cacheKey = cache.MakeKey(fixed, moving, settings.str());
+        field = cache.template LoadField<DisplacementFieldType>(cacheKey);
+    }
+    if (!field) {
+        field = EstimateDisplacementField(fixed, moving);
+        if (!m_CacheDirectory.empty()) {
+            RegistrationCache<ImageType> cache(m_CacheDirectory);
+            cache.template StoreField<DisplacementFieldType>(cacheKey, field);
+        }
+    }
+    return field;
+}
+
+template <typename TInputImage, typename TOutputImage>
+bool NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::EstimateIsCurrent() const {
+    const itk::ModifiedTimeType estimated = m_EstimateTime.GetMTime();
+    if (!m_Field || !m_Coefficients || estimated < this->GetMTime()) {
+        return false;
+    }
+    if (m_InitialTransform && estimated < m_InitialTransform->GetMTime()) {
+        return false;
+    }
+    for (unsigned int i = 0; i < 2; i++) {
+        const itk::DataObject *input = this->ProcessObject::GetInput(i);
+        if (!input || estimated < input->GetMTime() || estimated < input->GetUpdateMTime()) {
+            return false;
+        }
+    }
+    const itk::DataObject *transformInput = this->ProcessObject::GetInput(2);
+    if (transformInput && estimated < transformInput->GetUpdateMTime()) {
+        return false;
+    }
+    return true;
+}
+
+template <typename TInputImage, typename TOutputImage>
+void NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::GenerateInputRequestedRegion() {
+    Superclass::GenerateInputRequestedRegion();
+    for (unsigned int i = 0; i < 2; i++) {
+        ImageType *input = static_cast<ImageType *>(this->ProcessObject::GetInput(i));
+        if (input) {
+            input->SetRequestedRegionToLargestPossibleRegion();
+        }
+    }
 }
 
 template<typename TInputImage, typename TOutputImage>
@@ -181,3 +249,225 @@ const TInputImage *
 NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::GetMovingImage() {
     return static_cast<const ImageType*>(this->ProcessObject::GetInput(1));
 }
+
+template<typename TInputImage, typename TOutputImage>
+void NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::SetInitialTransformInput(const TransformInputType *input) {
+    if (input != this->GetInitialTransformInput()) {
+        this->ProcessObject::SetNthInput(2, const_cast<TransformInputType*>(input));
+        this->Modified();
+    }
+}
+
+template<typename TInputImage, typename TOutputImage>
+const typename NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::TransformInputType *
+NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::GetInitialTransformInput() const {
+    return static_cast<const TransformInputType*>(this->ProcessObject::GetInput(2));
+}
+
+template<typename TInputImage, typename TOutputImage>
+void NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::SetInitialTransform(const TransformBaseType *transform) {
+    if (transform == this->GetInitialTransform()) {
+        return;
+    }
+    typename TransformInputType::Pointer input;
+    if (transform) {
+        input = TransformInputType::New();
+        input->Set(transform);
+    }
+    this->SetInitialTransformInput(input);
+}
+
+template<typename TInputImage, typename TOutputImage>
+const typename NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::TransformBaseType *
+NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::GetInitialTransform() const {
+    const TransformInputType *input = this->GetInitialTransformInput();
+    return input ? input->Get() : ITK_NULLPTR;
+}
+
+
+template <typename TInputImage, typename TOutputImage>
+typename NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::DisplacementFieldTypePointer
+NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::EstimateDisplacementField(ImageType *fixed, ImageType *moving) {
+    if (m_DemonsLevels.empty()) {
+        itkExceptionMacro(<< "No Demons levels are configured");
+    }
+
+    // Reuse the fixed side of every level when only the moving image changed
+    const ImageType *fixedSource = this->GetFixedImage();
+    const bool reuseFixedLevels = m_FixedLevels.size() == m_DemonsLevels.size() && m_FixedLevelsSource == fixedSource
+        && m_FixedLevelsTime == fixedSource->GetMTime() && m_FixedLevelsSettings == FixedLevelSettings();
+    if (!reuseFixedLevels) {
+        m_FixedLevels.clear();
+        m_FixedLevelStatistics.clear();
+    }
+
+    // Attach inputs to the correct filters at the beginning of the composite pipeline.
+    // With an initial transform the moving image is mapped straight onto each
+    // level's fixed grid instead of being shrunk.
+    downsampleBaseline->SetInput(fixed);
+    downsampleLater->SetInput(moving);
+    if (m_InitialTransform) {
+        movingResample->SetInput(moving);
+        movingResample->SetTransform(m_InitialTransform);
+        movingResample->SetDefaultPixelValue(100);
+    }
+    baselineNormalize->SetInput(downsampleBaseline->GetOutput());
+    laterNormalize->SetInput(m_InitialTransform ? movingResample->GetOutput() : downsampleLater->GetOutput());
+
+    // Set up histogram matcher
+    matcher->SetInput( laterNormalize->GetOutput() );
+    matcher->SetNumberOfHistogramLevels( 1024 );
+    matcher->SetNumberOfMatchPoints( 10000 );
+    matcher->ThresholdAtMeanIntensityOn();
+
+    if (!m_UseFastIntensityMatching) {
+        filter->SetMovingImage( matcher->GetOutput() );
+    }
+    filter->SetStandardDeviations( 12.0 );
+    filter->SetMaximumRMSError( m_MaximumRMSError );
+    observer->SetMetricTolerance( m_MetricTolerance );
+    observer->SetPlateauIterations( m_PlateauIterations );
+
+    // Run the schedule from the coarsest level to the finest
+    const typename ImageType::SizeType& size = fixed->GetLargestPossibleRegion().GetSize();
+    DisplacementFieldTypePointer field;
+    for (size_t level = 0; level < m_DemonsLevels.size(); level++) {
+        const DemonsLevel& schedule = m_DemonsLevels[level];
+        std::ostringstream levelName;
+        levelName << "demons level " << level;
+
+        // Downsample, normalize and match intensities, then seed the field
+        {
+            StageTrace::Scope preprocessing(levelName.str() + " preprocessing");
+            for (unsigned int d = 0; d < DIMENSION; d++) {
+                const unsigned int factor = (d == DIMENSION - 1) ? schedule.sliceShrinkFactor : schedule.inPlaneShrinkFactor;
+                downsampleBaseline->SetShrinkFactor(d, std::max(1u, std::min<unsigned int>(factor, size[d])));
+                downsampleLater->SetShrinkFactor(d, std::max(1u, std::min<unsigned int>(factor, size[d])));
+            }
+            if (m_UseFastIntensityMatching) {
+                filter->SetMovingImage(MatchFastLevel(level, reuseFixedLevels));
+            }
+            else {
+                if (!reuseFixedLevels) {
+                    baselineNormalize->Update();
+                    typename InternalImageType::Pointer fixedLevel = baselineNormalize->GetOutput();
+                    fixedLevel->DisconnectPipeline();
+                    m_FixedLevels.push_back(fixedLevel);
+                }
+                if (m_InitialTransform) {
+                    movingResample->SetOutputParametersFromImage(m_FixedLevels[level]);
+                }
+                laterNormalize->Update();
+                matcher->SetReferenceImage( m_FixedLevels[level] );
+            }
+            InternalImageType *fixedLevel = m_FixedLevels[level];
+            filter->SetFixedImage( fixedLevel );
+
+            // Start from the previous level's field, upsampled onto this level's grid
+            if (field) {
+                typename ResampleFilterType::Pointer upsample = ResampleFilterType::New();
+                upsample->SetNumberOfThreads(this->GetNumberOfThreads());
+                upsample->SetTransform(transform);
+                upsample->SetInput(field);
+                upsample->SetOutputParametersFromImage(fixedLevel);
+                upsample->Update();
+                filter->SetInitialDisplacementField(upsample->GetOutput());
+            }
+            else {
+                filter->SetInitialDisplacementField(ITK_NULLPTR);
+            }
+        }
+
+        filter->SetNumberOfIterations( schedule.iterations );
+        observer->Reset();
+        {
+            StageTrace::Scope demons(levelName.str());
+            filter->UpdateLargestPossibleRegion();
+        }
+        StageTrace::Instance().Counter("demons iterations per level", filter->GetElapsedIterations());
+
+        // Keep this level's field and let the filter allocate a new one for the next level
+        field = filter->GetOutput();
+        field->DisconnectPipeline();
+    }
+    m_FixedLevelsSource = fixedSource;
+    m_FixedLevelsTime = fixedSource->GetMTime();
+    m_FixedLevelsSettings = FixedLevelSettings();
+
+    return field;
+}
+
+template <typename TInputImage, typename TOutputImage>
+typename NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::InternalImagePointer
+NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::MatchFastLevel(size_t level, bool reuseFixedLevel) {
+    // Shrink the fixed image unless its level is already prepared, and bring
+    // the moving image onto this level
+    typename InternalImageType::Pointer fixedLevel;
+    if (!reuseFixedLevel) {
+        downsampleBaseline->Update();
+        fixedLevel = downsampleBaseline->GetOutput();
+    }
+    if (m_InitialTransform) {
+        movingResample->SetOutputParametersFromImage(reuseFixedLevel ? m_FixedLevels[level].GetPointer() : fixedLevel.GetPointer());
+        movingResample->Update();
+    }
+    else {
+        downsampleLater->Update();
+    }
+    typename InternalImageType::Pointer movingLevel = m_InitialTransform ? movingResample->GetOutput() : downsampleLater->GetOutput();
+
+    // One statistics pass and one write pass over both images; the fixed
+    // image's statistics are kept with its prepared level
+    const unsigned int threads = this->GetNumberOfThreads();
+    typename FastMatchingType::Statistics fixedStatistics;
+    typename FastMatchingType::Statistics movingStatistics;
+    FastMatchingType::ComputeStatistics(fixedLevel, movingLevel, 1000, 1 << 20, threads, &fixedStatistics, &movingStatistics);
+    if (!reuseFixedLevel) {
+        m_FixedLevelStatistics.push_back(fixedStatistics);
+    }
+    typename InternalImageType::Pointer normalizedFixed;
+    typename InternalImageType::Pointer matchedMoving;
+    FastMatchingType::Apply(fixedLevel, movingLevel, m_FixedLevelStatistics[level], movingStatistics, threads, &normalizedFixed, &matchedMoving);
+    if (!reuseFixedLevel) {
+        m_FixedLevels.push_back(normalizedFixed);
+    }
+
+    if (m_ReleaseIntermediateData) {
+        movingLevel->ReleaseData();
+        if (fixedLevel) {
+            fixedLevel->ReleaseData();
+        }
+    }
+    return matchedMoving;
+}
+
+template <typename TInputImage, typename TOutputImage>
+std::string NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::FixedLevelSettings() const {
+    std::ostringstream settings;
+    settings << m_UseFastIntensityMatching << '|';
+    for (size_t level = 0; level < m_DemonsLevels.size(); level++) {
+        settings << m_DemonsLevels[level].inPlaneShrinkFactor << ',' << m_DemonsLevels[level].sliceShrinkFactor << '|';
+    }
+    return settings.str();
+}
+
+template<typename TInputImage, typename TOutputImage>
+void NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::AddDemonsLevel(unsigned int inPlaneShrinkFactor, unsigned int sliceShrinkFactor, unsigned int iterations) {
+    DemonsLevel level;
+    level.inPlaneShrinkFactor = std::max(1u, inPlaneShrinkFactor);
+    level.sliceShrinkFactor = std::max(1u, sliceShrinkFactor);
+    level.iterations = iterations;
+    m_DemonsLevels.push_back(level);
+    this->Modified();
+}
+
+template<typename TInputImage, typename TOutputImage>
+void NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::ClearDemonsLevels() {
+    m_DemonsLevels.clear();
+    this->Modified();
+}
+
+template<typename TInputImage, typename TOutputImage>
+unsigned int NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::GetNumberOfDemonsLevels() const {
+    return static_cast<unsigned int>(m_DemonsLevels.size());
+}
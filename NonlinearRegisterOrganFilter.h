@@ -1,5 +1,9 @@
 #pragma once
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <vector>
 #include "itkImageRegionIterator.h"
 #include <itkAffineTransform.h>
 #include <itkTranslationTransform.h>
@@ -12,12 +16,94 @@
 #include "itkHistogramMatchingImageFilter.h"
 #include "itkCastImageFilter.h"
 #include "itkWarpImageFilter.h"
+#include "itkBSplineDecompositionImageFilter.h"
+#include "itkBSplineResampleImageFunction.h"
 #include "itkShrinkImageFilter.h"
+#include "itkCompositeTransform.h"
+#include "itkDisplacementFieldTransform.h"
 #include <itkNormalizeImageFilter.h>
+#include "RegistrationCache.h"
+#include "IntensityMatching.h"
+#include "RoundingInterpolateImageFunction.h"
+#include "StageTrace.h"
+#include "itkCommand.h"
+#include "itkDataObjectDecorator.h"
 
 #define DIMENSION 3
 #define OUT_DIMENSION 3
 
+// Traces each Demons iteration and stops the filter once the metric has
+// not improved by the relative tolerance for a number of iterations.
+class CommandIterationUpdate : public itk::Command
+{
+    public:
+    typedef  CommandIterationUpdate                     Self;
+    typedef  itk::Command                               Superclass;
+    typedef  itk::SmartPointer<CommandIterationUpdate>  Pointer;
+
+    itkNewMacro( CommandIterationUpdate );
+    itkSetMacro( MetricTolerance, double );
+    itkSetMacro( PlateauIterations, unsigned int );
+
+    void Reset()
+    {
+        m_BestMetric = itk::NumericTraits<double>::max();
+        m_StalledIterations = 0;
+    }
+
+    protected:
+    CommandIterationUpdate()
+    {
+        m_MetricTolerance = 0.0;
+        m_PlateauIterations = 10;
+        Reset();
+    };
+
+    typedef itk::Image<float, 3>            InternalImageType;
+    typedef itk::Vector<float, 3>           VectorPixelType;
+    typedef itk::Image<VectorPixelType, 3>  DisplacementFieldType;
+    typedef itk::DemonsRegistrationFilter<InternalImageType, InternalImageType, DisplacementFieldType>   RegistrationFilterType;
+
+    public:
+
+    void Execute(itk::Object *caller, const itk::EventObject & event) ITK_OVERRIDE
+    {
+        Execute((const itk::Object *)caller, event);
+        if(!(itk::IterationEvent().CheckEvent(&event)) || m_MetricTolerance <= 0.0) {
+            return;
+        }
+
+        // The Demons metric is a mean squared difference, so lower is better
+        RegistrationFilterType * filter = static_cast<RegistrationFilterType *>(caller);
+        const double metric = filter->GetMetric();
+        if (metric < m_BestMetric - m_MetricTolerance * std::abs(m_BestMetric)) {
+            m_BestMetric = metric;
+            m_StalledIterations = 0;
+        }
+        else if (++m_StalledIterations >= m_PlateauIterations) {
+            filter->StopRegistration();
+        }
+    }
+
+    void Execute(const itk::Object * object, const itk::EventObject & event) ITK_OVERRIDE
+    {
+        const RegistrationFilterType * filter = static_cast<const RegistrationFilterType *>(object);
+        if(!(itk::IterationEvent().CheckEvent(&event))) {
+            return;
+        }
+        StageTrace &trace = StageTrace::Instance();
+        trace.Counter("demons iteration", filter->GetElapsedIterations());
+        trace.Counter("demons metric", filter->GetMetric());
+        trace.Counter("demons RMS change", filter->GetRMSChange());
+    }
+
+    private:
+    double m_MetricTolerance;
+    unsigned int m_PlateauIterations;
+    double m_BestMetric;
+    unsigned int m_StalledIterations;
+};
+
 template <typename TInputImage, typename TOutputImage>
 class NonlinearRegisterOrganFilter : public itk::ImageToImageFilter<TInputImage, TOutputImage>
 {
@@ -28,37 +114,145 @@ public:
     typedef itk::SmartPointer<const Self> ConstPointer;
     typedef TInputImage ImageType;
     typedef typename ImageType::PixelType PixelType;
+    typedef itk::Transform<double, DIMENSION, DIMENSION> TransformBaseType;
+    typedef itk::DataObjectDecorator<TransformBaseType> TransformInputType;
+
+    // Demons and its preprocessing run in float on the downsampled levels;
+    // the full resolution moving image keeps its own pixel type
+    typedef itk::Image<float, TInputImage::ImageDimension> InternalImageType;
 
     itkNewMacro(Self);
 
+    // Optional transform from the fixed image to the original moving image.
+    // When set, the moving image input is the original (unregistered) image:
+    // the transform is composed with the Demons field and the moving image is
+    // resampled once onto the fixed image's grid. As an input, e.g.
+    // RegisterOrganFilter::GetTransformOutput(), the transform is brought up
+    // to date by this filter's own update.
+    void SetInitialTransformInput(const TransformInputType *input);
+    const TransformInputType *GetInitialTransformInput() const;
+    void SetInitialTransform(const TransformBaseType *transform);
+    const TransformBaseType *GetInitialTransform() const;
+
+    // Directory for cached displacement fields; empty disables the cache
+    itkSetStringMacro(CacheDirectory);
+    itkGetStringMacro(CacheDirectory);
+
+    // Stop a level once the field's RMS change per iteration falls below this; 0 disables
+    itkSetMacro(MaximumRMSError, double);
+    itkGetMacro(MaximumRMSError, double);
+
+    // Stop a level once the metric has not improved by this relative amount
+    // for PlateauIterations iterations; 0 disables
+    itkSetMacro(MetricTolerance, double);
+    itkGetMacro(MetricTolerance, double);
+    itkSetMacro(PlateauIterations, unsigned int);
+    itkGetMacro(PlateauIterations, unsigned int);
+
+    // Free intermediate images once the next filter has used them, and drop
+    // every internal reference to the inputs when a run ends. The prepared
+    // fixed levels are kept; the estimate is kept until ReleaseEstimate().
+    itkSetMacro(ReleaseIntermediateData, bool);
+    itkGetMacro(ReleaseIntermediateData, bool);
+    itkBooleanMacro(ReleaseIntermediateData);
+
+    // Normalize and match each level's intensities with one statistics pass
+    // over both images and one write pass, using sampled quantiles, instead
+    // of NormalizeImageFilter and HistogramMatchingImageFilter
+    itkSetMacro(UseFastIntensityMatching, bool);
+    itkGetMacro(UseFastIntensityMatching, bool);
+    itkBooleanMacro(UseFastIntensityMatching);
+
     NonlinearRegisterOrganFilter();
     ~NonlinearRegisterOrganFilter();
     void GenerateData();
-    void NonlinearRegisterOrganFilter<TInputImage, TOutputImage>::SetFixedImage(const TInputImage *image);
+    void SetFixedImage(const ImageType *image);
     void SetMovingImage(const ImageType *image);
     const ImageType* GetFixedImage();
     const ImageType* GetMovingImage();
 
+    // Coarse-to-fine schedule. Each level starts from the previous level's field
+    // and runs at most the given number of iterations.
+    void AddDemonsLevel(unsigned int inPlaneShrinkFactor, unsigned int sliceShrinkFactor, unsigned int iterations);
+    void ClearDemonsLevels();
+    unsigned int GetNumberOfDemonsLevels() const;
+
+    // Drop the field and B-spline coefficients shared by the output regions
+    // of an update. Call once every region has been generated; a later
+    // update estimates again.
+    void ReleaseEstimate();
+
 protected:
+    // Fixed and moving scans need not share a grid
+    void VerifyInputInformation() {}
+
+    // The field is estimated from whole images; only the warp follows the
+    // output's requested region, so a streamed output is warped slab by slab
+    void GenerateInputRequestedRegion();
+
     // Define types
-    typedef itk::ShrinkImageFilter<ImageType, ImageType> DownsampleType;
+    typedef itk::ShrinkImageFilter<ImageType, InternalImageType> DownsampleType;
     typedef typename DownsampleType::Pointer DownsampleTypePointer;
-    typedef itk::NormalizeImageFilter<ImageType, ImageType> NormalizeType;
+    typedef itk::NormalizeImageFilter<InternalImageType, InternalImageType> NormalizeType;
     typedef typename NormalizeType::Pointer NormalizeTypePointer;
-    typedef itk::HistogramMatchingImageFilter<ImageType, ImageType> MatchingFilterType;
-    typedef typename itk::HistogramMatchingImageFilter<ImageType, ImageType>::Pointer MatchingFilterTypePointer;
+    typedef itk::HistogramMatchingImageFilter<InternalImageType, InternalImageType> MatchingFilterType;
+    typedef typename MatchingFilterType::Pointer MatchingFilterTypePointer;
+    typedef IntensityMatching<InternalImageType> FastMatchingType;
     typedef itk::Vector<float, DIMENSION> VectorPixelType;
     typedef itk::Image<VectorPixelType, DIMENSION> DisplacementFieldType;
-    typedef itk::DemonsRegistrationFilter<ImageType, ImageType, DisplacementFieldType> RegistrationFilterType;
-    typedef typename itk::DemonsRegistrationFilter<ImageType, ImageType, DisplacementFieldType>::Pointer RegistrationFilterTypePointer;
-    typedef itk::WarpImageFilter<itk::Image<float, DIMENSION>, ImageType, DisplacementFieldType> WarperType;
-    typedef typename itk::WarpImageFilter<itk::Image<float, DIMENSION>, ImageType, DisplacementFieldType>::Pointer WarperTypePointer;
-    typedef itk::BSplineInterpolateImageFunction<ImageType, double, double> InterpolatorType;
-    typedef typename itk::BSplineInterpolateImageFunction<ImageType, double, double>::Pointer InterpolatorTypePointer;
+    typedef typename DisplacementFieldType::Pointer DisplacementFieldTypePointer;
+    typedef itk::DemonsRegistrationFilter<InternalImageType, InternalImageType, DisplacementFieldType> RegistrationFilterType;
+    typedef typename RegistrationFilterType::Pointer RegistrationFilterTypePointer;
+    typedef itk::Image<double, DIMENSION> CoefficientImageType;
+    typedef typename CoefficientImageType::Pointer CoefficientImageTypePointer;
+    typedef itk::BSplineDecompositionImageFilter<ImageType, CoefficientImageType> CoefficientFilterType;
+    typedef typename CoefficientFilterType::Pointer CoefficientFilterTypePointer;
+    typedef itk::WarpImageFilter<CoefficientImageType, TOutputImage, DisplacementFieldType> WarperType;
+    typedef typename WarperType::Pointer WarperTypePointer;
+    typedef itk::BSplineResampleImageFunction<CoefficientImageType, double> InterpolatorType;
+    typedef typename InterpolatorType::Pointer InterpolatorTypePointer;
+    typedef RoundingInterpolateImageFunction<CoefficientImageType, typename TOutputImage::PixelType> OutputInterpolatorType;
+    typedef typename OutputInterpolatorType::Pointer OutputInterpolatorTypePointer;
     typedef itk::IdentityTransform<double, DIMENSION> IdentityTransformType;
     typedef typename itk::IdentityTransform<double, DIMENSION>::Pointer IdentityTransformTypePointer;
     typedef itk::ResampleImageFilter<itk::Image<VectorPixelType, DIMENSION>, itk::Image<VectorPixelType, DIMENSION>> ResampleFilterType;
     typedef typename itk::ResampleImageFilter<itk::Image<VectorPixelType, DIMENSION>, itk::Image<VectorPixelType, DIMENSION>>::Pointer ResampleFilterTypePointer;
+    typedef itk::ResampleImageFilter<ImageType, InternalImageType> MovingResampleFilterType;
+    typedef typename MovingResampleFilterType::Pointer MovingResampleFilterTypePointer;
+    typedef itk::ResampleImageFilter<CoefficientImageType, TOutputImage> ComposedResampleFilterType;
+    typedef typename ComposedResampleFilterType::Pointer ComposedResampleFilterTypePointer;
+    typedef itk::DisplacementFieldTransform<double, DIMENSION> DisplacementTransformType;
+    typedef typename DisplacementTransformType::DisplacementFieldType ComposedFieldType;
+    typedef itk::CastImageFilter<DisplacementFieldType, ComposedFieldType> FieldCastFilterType;
+    typedef typename FieldCastFilterType::Pointer FieldCastFilterTypePointer;
+    typedef itk::CompositeTransform<double, DIMENSION> CompositeTransformType;
+
+    struct DemonsLevel {
+        unsigned int inPlaneShrinkFactor;
+        unsigned int sliceShrinkFactor;
+        unsigned int iterations;
+    };
+
+    // (Re)create the internal filters that hold images between runs
+    void CreateInternalFilters();
+
+    // Cached or freshly estimated field for the current inputs and settings
+    DisplacementFieldTypePointer UpdateDisplacementField(ImageType *fixed, ImageType *moving);
+
+    // Run Demons on the downsampled, intensity matched images
+    DisplacementFieldTypePointer EstimateDisplacementField(ImageType *fixed, ImageType *moving);
+
+    // Whether the field and coefficients were computed after the inputs,
+    // settings and initial transform last changed
+    bool EstimateIsCurrent() const;
+
+    // Shrink, normalize and match one level with IntensityMatching; stores the
+    // fixed level if it is new and returns the matched moving level
+    typedef typename InternalImageType::Pointer InternalImagePointer;
+    InternalImagePointer MatchFastLevel(size_t level, bool reuseFixedLevel);
+
+    // Settings that the preprocessed fixed levels depend on
+    std::string FixedLevelSettings() const;
 
 private:
     // Define variables
@@ -70,6 +264,35 @@ private:
     RegistrationFilterTypePointer filter;
     WarperTypePointer warper;
     InterpolatorTypePointer interpolator;
+    OutputInterpolatorTypePointer outputInterpolator;
     IdentityTransformTypePointer transform;
     ResampleFilterTypePointer resample;
+    MovingResampleFilterTypePointer movingResample;
+    ComposedResampleFilterTypePointer composedResample;
+    FieldCastFilterTypePointer fieldCast;
+    CoefficientFilterTypePointer coefficientFilter;
+    typename TransformBaseType::ConstPointer m_InitialTransform;
+    CommandIterationUpdate::Pointer observer;
+    std::vector<DemonsLevel> m_DemonsLevels;
+
+    // Estimate shared by every output region of a streamed update
+    DisplacementFieldTypePointer m_Field;
+    CoefficientImageTypePointer m_Coefficients;
+    itk::TimeStamp m_EstimateTime;
+
+    // Downsampled, normalized fixed image for each level, which is also the
+    // histogram matching reference. Kept while the fixed input and schedule
+    // stay the same, so several moving images reuse one preparation.
+    std::vector<typename InternalImageType::Pointer> m_FixedLevels;
+    std::vector<typename FastMatchingType::Statistics> m_FixedLevelStatistics;
+    const ImageType *m_FixedLevelsSource;
+    itk::ModifiedTimeType m_FixedLevelsTime;
+    std::string m_FixedLevelsSettings;
+
+    std::string m_CacheDirectory;
+    double m_MaximumRMSError;
+    double m_MetricTolerance;
+    unsigned int m_PlateauIterations;
+    bool m_ReleaseIntermediateData;
+    bool m_UseFastIntensityMatching;
 };
@@ -0,0 +1,155 @@
+#include "ParallelSeriesReader.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+template <typename TOutputImage>
+ParallelSeriesReader<TOutputImage>::ParallelSeriesReader()
+{
+    m_NumberOfWorkers = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+}
+
+template <typename TOutputImage>
+ParallelSeriesReader<TOutputImage>::~ParallelSeriesReader()
+{
+    //
+}
+
+template <typename TOutputImage>
+void ParallelSeriesReader<TOutputImage>::SetFileNames(const FileNamesContainer &fileNames) {
+    m_FileNames = fileNames;
+    this->Modified();
+}
+
+template <typename TOutputImage>
+const typename ParallelSeriesReader<TOutputImage>::FileNamesContainer &
+ParallelSeriesReader<TOutputImage>::GetFileNames() const {
+    return m_FileNames;
+}
+
+template <typename TOutputImage>
+void ParallelSeriesReader<TOutputImage>::GenerateOutputInformation() {
+    const unsigned int sliceDimension = ImageType::ImageDimension - 1;
+    if (m_FileNames.empty()) {
+        itkExceptionMacro(<< "No slice files to read");
+    }
+
+    // Read the geometry of the first slice. This also registers the ImageIO
+    // factories on this thread before any worker creates a reader.
+    HeaderReaderTypePointer firstReader = HeaderReaderType::New();
+    firstReader->SetFileName(m_FileNames.front());
+    firstReader->UpdateOutputInformation();
+    const ImageType *first = firstReader->GetOutput();
+
+    typename ImageType::SizeType size = first->GetLargestPossibleRegion().GetSize();
+    typename ImageType::SpacingType spacing = first->GetSpacing();
+    typename ImageType::PointType origin = first->GetOrigin();
+    typename ImageType::DirectionType direction = first->GetDirection();
+    size[sliceDimension] = m_FileNames.size();
+
+    // Derive the slice spacing and direction from the first and last slice
+    // positions, as the series reader does
+    if (m_FileNames.size() > 1) {
+        HeaderReaderTypePointer lastReader = HeaderReaderType::New();
+        lastReader->SetFileName(m_FileNames.back());
+        lastReader->UpdateOutputInformation();
+        const typename ImageType::PointType last = lastReader->GetOutput()->GetOrigin();
+
+        const double norm = last.EuclideanDistanceTo(origin);
+        if (norm > 0.0) {
+            spacing[sliceDimension] = norm / (m_FileNames.size() - 1);
+            for (unsigned int d = 0; d < ImageType::ImageDimension; d++) {
+                direction[d][sliceDimension] = (last[d] - origin[d]) / norm;
+            }
+        }
+    }
+
+    typename ImageType::RegionType region;
+    region.SetSize(size);
+
+    ImageType *output = this->GetOutput();
+    output->SetLargestPossibleRegion(region);
+    output->SetSpacing(spacing);
+    output->SetOrigin(origin);
+    output->SetDirection(direction);
+}
+
+template <typename TOutputImage>
+void ParallelSeriesReader<TOutputImage>::EnlargeOutputRequestedRegion(itk::DataObject *output) {
+    // Always decode the whole series
+    ImageType *image = dynamic_cast<ImageType *>(output);
+    if (image) {
+        image->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+template <typename TOutputImage>
+void ParallelSeriesReader<TOutputImage>::GenerateData() {
+    ImageType *output = this->GetOutput();
+    output->SetBufferedRegion(output->GetRequestedRegion());
+    output->Allocate();
+
+    const typename ImageType::SizeType& size = output->GetLargestPossibleRegion().GetSize();
+    size_t sliceVoxels = 1;
+    for (unsigned int d = 0; d < ImageType::ImageDimension - 1; d++) {
+        sliceVoxels *= size[d];
+    }
+    PixelType *buffer = output->GetBufferPointer();
+
+    // Workers pull the next slice index, decode it and copy it into its slot
+    std::atomic<size_t> nextSlice(0);
+    std::mutex errorLock;
+    std::string error;
+    auto worker = [&]() {
+        for (size_t slice = nextSlice++; slice < m_FileNames.size(); slice = nextSlice++) {
+            try {
+                SliceReaderTypePointer reader = SliceReaderType::New();
+                reader->SetFileName(m_FileNames[slice]);
+                reader->Update();
+                const SliceType *image = reader->GetOutput();
+                if (image->GetBufferedRegion().GetNumberOfPixels() != sliceVoxels) {
+                    itkGenericExceptionMacro(<< "Slice " << m_FileNames[slice] << " does not match the size of the first slice");
+                }
+                std::memcpy(buffer + slice * sliceVoxels, image->GetBufferPointer(), sliceVoxels * sizeof(PixelType));
+            }
+            catch (itk::ExceptionObject &e) {
+                std::lock_guard<std::mutex> lock(errorLock);
+                if (error.empty()) {
+                    error = e.GetDescription();
+                }
+                nextSlice = m_FileNames.size();
+            }
+            catch (std::exception &e) {
+                std::lock_guard<std::mutex> lock(errorLock);
+                if (error.empty()) {
+                    error = m_FileNames[slice] + ": " + e.what();
+                }
+                nextSlice = m_FileNames.size();
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(errorLock);
+                if (error.empty()) {
+                    error = m_FileNames[slice] + ": unknown error";
+                }
+                nextSlice = m_FileNames.size();
+            }
+        }
+    };
+
+    const unsigned int workers = std::max(1u, std::min<unsigned int>(m_NumberOfWorkers, m_FileNames.size()));
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < workers; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    if (!error.empty()) {
+        itkExceptionMacro(<< error);
+    }
+}
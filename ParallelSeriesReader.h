@@ -0,0 +1,50 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <itkImage.h>
+#include <itkImageSource.h>
+#include <itkImageFileReader.h>
+#include <itkMultiThreader.h>
+
+// Reads a numbered series of 2D slices into one volume, decoding slices on
+// several threads straight into the output buffer. Produces the same image
+// as itk::ImageSeriesReader for 2D slice files.
+template <typename TOutputImage>
+class ParallelSeriesReader : public itk::ImageSource<TOutputImage>
+{
+public:
+    typedef ParallelSeriesReader<TOutputImage> Self;
+    typedef itk::ImageSource<TOutputImage> Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    typedef itk::SmartPointer<const Self> ConstPointer;
+    typedef TOutputImage ImageType;
+    typedef typename ImageType::PixelType PixelType;
+    typedef std::vector<std::string> FileNamesContainer;
+
+    itkNewMacro(Self);
+    itkSetMacro(NumberOfWorkers, unsigned int);
+    itkGetMacro(NumberOfWorkers, unsigned int);
+
+    ParallelSeriesReader();
+    ~ParallelSeriesReader();
+    void SetFileNames(const FileNamesContainer &fileNames);
+    const FileNamesContainer& GetFileNames() const;
+
+protected:
+    typedef itk::Image<PixelType, ImageType::ImageDimension - 1> SliceType;
+    typedef itk::ImageFileReader<SliceType> SliceReaderType;
+    typedef typename SliceReaderType::Pointer SliceReaderTypePointer;
+
+    // Slice headers are read as volumes so that each slice keeps its
+    // position along the series axis; pixels are decoded as 2D slices
+    typedef itk::ImageFileReader<ImageType> HeaderReaderType;
+    typedef typename HeaderReaderType::Pointer HeaderReaderTypePointer;
+
+    void GenerateOutputInformation();
+    void EnlargeOutputRequestedRegion(itk::DataObject *output);
+    void GenerateData();
+
+private:
+    FileNamesContainer m_FileNames;
+    unsigned int m_NumberOfWorkers;
+};
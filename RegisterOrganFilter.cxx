@@ -3,42 +3,30 @@
 template <typename TInputImage, typename TOutputImage>
 RegisterOrganFilter<TInputImage, TOutputImage>::RegisterOrganFilter()
 {
-    downsampleBaseline = DownsampleType::New();
-    downsampleLater = DownsampleType::New();
+    CreateInternalFilters();
     transform = TransformType::New();
     optimizer = OptimizerType::New();
-    interpolator = InterpolatorType::New();
-    registration = RegistrationType::New();
-    metric = MetricType::New();
-    baselineNormalize = NormalizeType::New();
-    laterNormalize = NormalizeType::New();
-    baselineGaussianFilter = GaussianFilterType::New();
-    laterGaussianFilter = GaussianFilterType::New();
-    transformInitializer = TransformInitializerType::New();
+    optimizerObserver = OptimizerIterationTrace::New();
+    optimizer->AddObserver(itk::IterationEvent(), optimizerObserver);
     finalTransform = TransformType::New();
     resample = ResampleFilterType::New();
+    this->SetNumberOfRequiredOutputs(2);
+    this->SetNthOutput(1, this->MakeOutput(1));
 
-    // Set up downsampling
-    downsampleBaseline->SetShrinkFactor(0, 4);
-    downsampleBaseline->SetShrinkFactor(1, 4);
-    downsampleBaseline->SetShrinkFactor(2, 4);
-
-    downsampleLater->SetShrinkFactor(0, 4);
-    downsampleLater->SetShrinkFactor(1, 4);
-    downsampleLater->SetShrinkFactor(2, 4);
-
-    // Set up metric
-    metric->SetFixedImageStandardDeviation(0.4);
-    metric->SetMovingImageStandardDeviation(0.4);
+    m_ResampleMovingImage = true;
+    m_UseRecursiveGaussian = false;
+    m_ReleaseIntermediateData = false;
+    m_SimilarityMetric = ViolaWellsMutualInformation;
+    m_RandomSeed = 121212;
+    m_NumberOfStarts = 1;
+    m_FixedLevelsSource = ITK_NULLPTR;
+    m_FixedLevelsTime = 0;
 
-    // Set up optimizer
-    optimizer->SetMaximumStepLength(0.1);
-    optimizer->SetMinimumStepLength(0.01);
-    optimizer->SetNumberOfIterations(500);
-    optimizer->MaximizeOn();
+    // Default schedule is a single level at 1/4 resolution
+    AddPyramidLevel(4, 500, 0.1, 0.01);
 
-   
     resample->SetDefaultPixelValue(100);
+    resample->SetInterpolator(ResampleInterpolatorType::New());
 }
 
 template <typename TInputImage, typename TOutputImage>
@@ -47,6 +35,20 @@ RegisterOrganFilter<TInputImage, TOutputImage>::~RegisterOrganFilter()
     //
 }
 
+template <typename TInputImage, typename TOutputImage>
+void RegisterOrganFilter<TInputImage, TOutputImage>::CreateInternalFilters() {
+    downsampleBaseline = DownsampleType::New();
+    downsampleLater = DownsampleType::New();
+    interpolator = InterpolatorType::New();
+    registration = RegistrationType::New();
+    baselineNormalize = NormalizeType::New();
+    laterNormalize = NormalizeType::New();
+    baselineGaussianFilter = GaussianFilterType::New();
+    laterGaussianFilter = GaussianFilterType::New();
+    transformInitializer = TransformInitializerType::New();
+    metric = ITK_NULLPTR;
+}
+
 template <typename TInputImage, typename TOutputImage>
 void RegisterOrganFilter<TInputImage, TOutputImage>::GenerateData() {
     // Graft fixed image input
@@ -58,54 +60,34 @@ void RegisterOrganFilter<TInputImage, TOutputImage>::GenerateData() {
     moving->Graft(this->GetMovingImage());
 
 
-    // Attach inputs to the correct filters at the beginning of the composite pipeline
-    downsampleBaseline->SetInput(fixed);
-    downsampleLater->SetInput(moving);
-    downsampleBaseline->Update();
-    downsampleLater->Update();
-
-    // Set up normalize
-    baselineNormalize->SetInput(downsampleBaseline->GetOutput());
-    laterNormalize->SetInput(downsampleLater->GetOutput());
-
-    // Set up GaussianFilter
-    baselineGaussianFilter->SetVariance(2.0);
-    laterGaussianFilter->SetVariance(2.0);
-
-    baselineGaussianFilter->SetInput(baselineNormalize->GetOutput());
-    laterGaussianFilter->SetInput(laterNormalize->GetOutput());
-    baselineGaussianFilter->Update();
-    laterGaussianFilter->Update();
+    // Internal filters share this filter's thread count
+    const itk::ThreadIdType threads = this->GetNumberOfThreads();
+    downsampleBaseline->SetNumberOfThreads(threads);
+    downsampleLater->SetNumberOfThreads(threads);
+    baselineNormalize->SetNumberOfThreads(threads);
+    laterNormalize->SetNumberOfThreads(threads);
+    baselineGaussianFilter->SetNumberOfThreads(threads);
+    laterGaussianFilter->SetNumberOfThreads(threads);
+    resample->SetNumberOfThreads(threads);
 
-    // Set up registration
-    registration->SetOptimizer(optimizer);
-    registration->SetTransform(transform);
-    registration->SetMetric(metric);
-    registration->SetInterpolator(interpolator);
-    registration->SetFixedImage(baselineGaussianFilter->GetOutput());
-    registration->SetMovingImage(laterGaussianFilter->GetOutput());
+    // Each level's downsampled and normalized images are only read by the next filter
+    downsampleBaseline->SetReleaseDataFlag(m_ReleaseIntermediateData);
+    downsampleLater->SetReleaseDataFlag(m_ReleaseIntermediateData);
+    baselineNormalize->SetReleaseDataFlag(m_ReleaseIntermediateData);
+    laterNormalize->SetReleaseDataFlag(m_ReleaseIntermediateData);
 
-    // Set up baseline region
-    ImageType::RegionType baselineRegion = baselineNormalize->GetOutput()->GetBufferedRegion();
-    registration->SetFixedImageRegion(baselineRegion);
-    
-    // Initialize transform
-    transformInitializer->SetFixedImage(fixed);
-    transformInitializer->SetMovingImage(moving);
-    transformInitializer->SetTransform(transform);
-    transformInitializer->MomentsOn();
-    transformInitializer->InitializeTransform();
-    registration->SetInitialTransformParameters(transform->GetParameters());
+    // Estimate once; further output regions of the same update only resample
+    if (!TransformIsCurrent()) {
+        UpdateFinalTransform(fixed, moving);
+        m_FinalTransformTime.Modified();
+    }
 
-    // Calculate and set the number of samples used
-    const unsigned int numSamples = static_cast<unsigned int>(baselineRegion.GetNumberOfPixels() * 0.01);
-    metric->SetNumberOfSpatialSamples(numSamples);
-    registration->Update();
+    // Outputs are cleared before every run, so decorate the transform again
+    static_cast<TransformOutputType *>(this->ProcessObject::GetOutput(1))->Set(finalTransform);
 
-    // Final transform
-    RegistrationType::ParametersType finalParameters = registration->GetLastTransformParameters();
-    finalTransform->SetParameters(finalParameters);
-    finalTransform->SetFixedParameters(transform->GetFixedParameters());
+    if (!m_ResampleMovingImage) {
+        return;
+    }
 
     // Resample
     resample->SetTransform(finalTransform);
@@ -116,9 +98,81 @@ void RegisterOrganFilter<TInputImage, TOutputImage>::GenerateData() {
     resample->SetOutputDirection(this->GetFixedImage()->GetDirection());
 
     // Graft outputs at end of the pipeline
+    StageTrace::Scope resampling("affine resample");
     resample->GraftOutput(this->GetOutput());
     resample->Update();
     this->GraftOutput(resample->GetOutput());
+    if (m_ReleaseIntermediateData) {
+        // Leave the output buffer referenced only by this filter's output
+        resample->GetOutput()->ReleaseData();
+    }
+}
+
+template <typename TInputImage, typename TOutputImage>
+void RegisterOrganFilter<TInputImage, TOutputImage>::UpdateFinalTransform(ImageType *fixed, ImageType *moving) {
+    // Reuse a cached transform for identical inputs and settings
+    std::string cacheKey;
+    bool cached = false;
+    if (!m_CacheDirectory.empty()) {
+        std::ostringstream settings;
+        settings << "affine|" << m_UseRecursiveGaussian << '|' << m_SimilarityMetric << ',' << m_NumberOfStarts;
+        if (MetricSamplesRandomly()) {
+            settings << ',' << m_RandomSeed;
+        }
+        for (size_t level = 0; level < m_PyramidLevels.size(); level++) {
+            settings << '|' << m_PyramidLevels[level].shrinkFactor << ',' << m_PyramidLevels[level].iterations
+                     << ',' << m_PyramidLevels[level].maximumStepLength << ',' << m_PyramidLevels[level].minimumStepLength;
+        }
+        RegistrationCache<ImageType> cache(m_CacheDirectory);
+        cacheKey = cache.MakeKey(fixed, moving, settings.str());
+
+        typename TransformType::ParametersType parameters;
+        typename TransformType::ParametersType fixedParameters;
+        if (cache.LoadParameters(cacheKey, parameters, fixedParameters) && parameters.GetSize() == finalTransform->GetNumberOfParameters()) {
+            finalTransform->SetFixedParameters(fixedParameters);
+            finalTransform->SetParameters(parameters);
+            cached = true;
+        }
+    }
+    if (!cached) {
+        EstimateTransform(fixed, moving);
+        if (!m_CacheDirectory.empty()) {
+            RegistrationCache<ImageType> cache(m_CacheDirectory);
+            cache.StoreParameters(cacheKey, finalTransform->GetParameters(), finalTransform->GetFixedParameters());
+        }
+    }
+
+    if (m_ReleaseIntermediateData) {
+        // The grafted inputs and the last level's images are referenced by the
+        // filters and registration objects until they are replaced
+        CreateInternalFilters();
+    }
+}
+
+template <typename TInputImage, typename TOutputImage>
+bool RegisterOrganFilter<TInputImage, TOutputImage>::TransformIsCurrent() const {
+    const itk::ModifiedTimeType estimated = m_FinalTransformTime.GetMTime();
+    if (estimated == 0 || estimated < this->GetMTime()) {
+        return false;
+    }
+    for (unsigned int i = 0; i < 2; i++) {
+        const itk::DataObject *input = this->ProcessObject::GetInput(i);
+        if (!input || estimated < input->GetMTime() || estimated < input->GetUpdateMTime()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename TInputImage, typename TOutputImage>
+void RegisterOrganFilter<TInputImage, TOutputImage>::GenerateInputRequestedRegion() {
+    Superclass::GenerateInputRequestedRegion();
+    for (unsigned int i = 0; i < 2; i++) {
+        ImageType *input = static_cast<ImageType *>(this->ProcessObject::GetInput(i));
+        if (input) {
+            input->SetRequestedRegionToLargestPossibleRegion();
+        }
+    }
 }
 
 template<typename TInputImage, typename TOutputImage>
@@ -147,4 +201,365 @@ template<typename TInputImage, typename TOutputImage>
 const TInputImage *
 RegisterOrganFilter<TInputImage, TOutputImage>::GetMovingImage() {
     return static_cast<const ImageType*>(this->ProcessObject::GetInput(1));
+}
+
+template<typename TInputImage, typename TOutputImage>
+const typename RegisterOrganFilter<TInputImage, TOutputImage>::TransformType *
+RegisterOrganFilter<TInputImage, TOutputImage>::GetFinalTransform() const {
+    return finalTransform;
+}
+
+template<typename TInputImage, typename TOutputImage>
+const typename RegisterOrganFilter<TInputImage, TOutputImage>::TransformOutputType *
+RegisterOrganFilter<TInputImage, TOutputImage>::GetTransformOutput() const {
+    return static_cast<const TransformOutputType *>(this->ProcessObject::GetOutput(1));
+}
+
+template<typename TInputImage, typename TOutputImage>
+typename RegisterOrganFilter<TInputImage, TOutputImage>::DataObjectPointer
+RegisterOrganFilter<TInputImage, TOutputImage>::MakeOutput(DataObjectPointerArraySizeType index) {
+    if (index == 1) {
+        return TransformOutputType::New().GetPointer();
+    }
+    return Superclass::MakeOutput(index);
+}
+
+template<typename TInputImage, typename TOutputImage>
+void RegisterOrganFilter<TInputImage, TOutputImage>::AddPyramidLevel(unsigned int shrinkFactor, unsigned int iterations, double maximumStepLength, double minimumStepLength) {
+    PyramidLevel level;
+    level.shrinkFactor = std::max(1u, shrinkFactor);
+    level.iterations = iterations;
+    level.maximumStepLength = maximumStepLength;
+    level.minimumStepLength = minimumStepLength;
+    m_PyramidLevels.push_back(level);
+    this->Modified();
+}
+
+template<typename TInputImage, typename TOutputImage>
+void RegisterOrganFilter<TInputImage, TOutputImage>::ClearPyramidLevels() {
+    m_PyramidLevels.clear();
+    this->Modified();
+}
+
+template<typename TInputImage, typename TOutputImage>
+unsigned int RegisterOrganFilter<TInputImage, TOutputImage>::GetNumberOfPyramidLevels() const {
+    return static_cast<unsigned int>(m_PyramidLevels.size());
+}
+
+template <typename TInputImage, typename TOutputImage>
+void RegisterOrganFilter<TInputImage, TOutputImage>::EstimateTransform(ImageType *fixed, ImageType *moving) {
+    // Reuse the fixed side of the pyramid when only the moving image changed
+    const ImageType *fixedSource = this->GetFixedImage();
+    const bool reuseFixedLevels = m_FixedLevels.size() == m_PyramidLevels.size() && m_FixedLevelsSource == fixedSource
+        && m_FixedLevelsTime == fixedSource->GetMTime() && m_FixedLevelsSettings == FixedLevelSettings();
+    if (!reuseFixedLevels) {
+        m_FixedLevels.clear();
+    }
+
+    // Attach inputs to the correct filters at the beginning of the composite pipeline
+    downsampleBaseline->SetInput(fixed);
+    downsampleLater->SetInput(moving);
+
+    // Set up normalize
+    baselineNormalize->SetInput(downsampleBaseline->GetOutput());
+    laterNormalize->SetInput(downsampleLater->GetOutput());
+
+    // Set up GaussianFilter
+    baselineGaussianFilter->SetVariance(2.0);
+    laterGaussianFilter->SetVariance(2.0);
+    baselineGaussianFilter->SetUseRecursive(m_UseRecursiveGaussian);
+    laterGaussianFilter->SetUseRecursive(m_UseRecursiveGaussian);
+
+    baselineGaussianFilter->SetInput(baselineNormalize->GetOutput());
+    laterGaussianFilter->SetInput(laterNormalize->GetOutput());
+
+    // Set up registration
+    metric = CreateMetric(optimizer);
+    metric->SetNumberOfThreads(this->GetNumberOfThreads());
+    registration->SetOptimizer(optimizer);
+    registration->SetTransform(transform);
+    registration->SetMetric(metric);
+    registration->SetInterpolator(interpolator);
+
+    // Initialize transform
+    transformInitializer->SetFixedImage(fixed);
+    transformInitializer->SetMovingImage(moving);
+    transformInitializer->SetTransform(transform);
+    transformInitializer->MomentsOn();
+    transformInitializer->InitializeTransform();
+    typename RegistrationType::ParametersType levelParameters = transform->GetParameters();
+
+    // Run the schedule from the coarsest level to the finest
+    const typename ImageType::SizeType& fixedSize = fixed->GetLargestPossibleRegion().GetSize();
+    const typename ImageType::SizeType& movingSize = moving->GetLargestPossibleRegion().GetSize();
+    for (size_t level = 0; level < m_PyramidLevels.size(); level++) {
+        const PyramidLevel& schedule = m_PyramidLevels[level];
+
+        // Downsample to this level, never past a single voxel along an axis
+        for (unsigned int d = 0; d < DIMENSION; d++) {
+            downsampleBaseline->SetShrinkFactor(d, std::max(1u, std::min<unsigned int>(schedule.shrinkFactor, fixedSize[d])));
+            downsampleLater->SetShrinkFactor(d, std::max(1u, std::min<unsigned int>(schedule.shrinkFactor, movingSize[d])));
+        }
+        std::ostringstream levelName;
+        levelName << "affine level " << level;
+        {
+            StageTrace::Scope preprocessing(levelName.str() + " preprocessing");
+            if (!reuseFixedLevels) {
+                baselineGaussianFilter->Update();
+                typename InternalImageType::Pointer fixedLevel = baselineGaussianFilter->GetOutput();
+                fixedLevel->DisconnectPipeline();
+                m_FixedLevels.push_back(fixedLevel);
+            }
+            laterGaussianFilter->Update();
+        }
+
+        // Detach this level's moving image so concurrent starts can share it
+        typename InternalImageType::Pointer movingLevel = laterGaussianFilter->GetOutput();
+        movingLevel->DisconnectPipeline();
+
+        if (level == 0 && m_NumberOfStarts > 1) {
+            // Short probes pick the start; only the winner runs the full level
+            StageTrace::Scope probe(levelName.str() + " multi-start");
+            levelParameters = RunStarts(m_FixedLevels[level], movingLevel, schedule, levelParameters);
+        }
+
+        // Set up baseline region
+        const typename InternalImageType::RegionType baselineRegion = m_FixedLevels[level]->GetBufferedRegion();
+        registration->SetFixedImage(m_FixedLevels[level]);
+        registration->SetMovingImage(movingLevel);
+        registration->SetFixedImageRegion(baselineRegion);
+
+        // Seed from the previous level
+        optimizer->SetMaximumStepLength(schedule.maximumStepLength);
+        optimizer->SetMinimumStepLength(schedule.minimumStepLength);
+        optimizer->SetNumberOfIterations(schedule.iterations);
+        registration->SetInitialTransformParameters(levelParameters);
+
+        SetMetricSamples(metric, baselineRegion);
+        {
+            StageTrace::Scope optimize(levelName.str());
+            registration->Update();
+        }
+        StageTrace::Instance().Counter("affine iterations per level", optimizer->GetCurrentIteration());
+
+        levelParameters = registration->GetLastTransformParameters();
+    }
+    m_FixedLevelsSource = fixedSource;
+    m_FixedLevelsTime = fixedSource->GetMTime();
+    m_FixedLevelsSettings = FixedLevelSettings();
+
+    // Final transform
+    finalTransform->SetParameters(levelParameters);
+    finalTransform->SetFixedParameters(transform->GetFixedParameters());
+}
+
+
+template <typename TInputImage, typename TOutputImage>
+std::string RegisterOrganFilter<TInputImage, TOutputImage>::FixedLevelSettings() const {
+    std::ostringstream settings;
+    settings << m_UseRecursiveGaussian;
+    for (size_t level = 0; level < m_PyramidLevels.size(); level++) {
+        settings << '|' << m_PyramidLevels[level].shrinkFactor;
+    }
+    return settings.str();
+}
+
+template <typename TInputImage, typename TOutputImage>
+typename RegisterOrganFilter<TInputImage, TOutputImage>::MetricTypePointer
+RegisterOrganFilter<TInputImage, TOutputImage>::CreateMetric(OptimizerType *target) const {
+    MetricTypePointer created;
+    switch (m_SimilarityMetric) {
+    case MattesMutualInformation: {
+        typename MattesMetricType::Pointer mattes = MattesMetricType::New();
+        mattes->SetNumberOfHistogramBins(50);
+        created = mattes;
+        // Mattes reports negative mutual information
+        target->MinimizeOn();
+        break;
+    }
+    case NormalizedCorrelation: {
+        typename CorrelationMetricType::Pointer correlation = CorrelationMetricType::New();
+        correlation->SubtractMeanOn();
+        created = correlation;
+        // Reported as negative correlation
+        target->MinimizeOn();
+        break;
+    }
+    case MeanSquares:
+        created = MeanSquaresMetricType::New();
+        target->MinimizeOn();
+        break;
+    default: {
+        typename ViolaWellsMetricType::Pointer violaWells = ViolaWellsMetricType::New();
+        violaWells->SetFixedImageStandardDeviation(0.4);
+        violaWells->SetMovingImageStandardDeviation(0.4);
+        created = violaWells;
+        target->MaximizeOn();
+        break;
+    }
+    }
+    ReseedMetric(created);
+    return created;
+}
+
+template <typename TInputImage, typename TOutputImage>
+bool RegisterOrganFilter<TInputImage, TOutputImage>::MetricSamplesRandomly() const {
+    return m_SimilarityMetric == MattesMutualInformation || m_SimilarityMetric == ViolaWellsMutualInformation;
+}
+
+template <typename TInputImage, typename TOutputImage>
+void RegisterOrganFilter<TInputImage, TOutputImage>::ReseedMetric(MetricType *target) const {
+    // Mattes draws its samples once in Initialize; Viola-Wells draws new
+    // ones on every evaluation
+    switch (m_SimilarityMetric) {
+    case MattesMutualInformation:
+        static_cast<MattesMetricType *>(target)->ReinitializeSeed(m_RandomSeed);
+        break;
+    case ViolaWellsMutualInformation:
+        static_cast<ViolaWellsMetricType *>(target)->ReinitializeSeed(m_RandomSeed);
+        break;
+    default:
+        break;
+    }
+}
+
+template <typename TInputImage, typename TOutputImage>
+void RegisterOrganFilter<TInputImage, TOutputImage>::SetMetricSamples(MetricType *target, const typename InternalImageType::RegionType& region) const {
+    // Mutual information uses 1% of the voxels; correlation and mean squares
+    // are cheap enough per voxel to use all of them at the coarse levels
+    const unsigned int numSamples = static_cast<unsigned int>(region.GetNumberOfPixels() * 0.01);
+    switch (m_SimilarityMetric) {
+    case MattesMutualInformation:
+        target->SetUseAllPixels(false);
+        target->SetNumberOfSpatialSamples(numSamples);
+        break;
+    case NormalizedCorrelation:
+    case MeanSquares:
+        target->SetUseAllPixels(true);
+        break;
+    default:
+        static_cast<ViolaWellsMetricType *>(target)->SetNumberOfSpatialSamples(numSamples);
+        break;
+    }
+}
+
+template <typename TInputImage, typename TOutputImage>
+typename RegisterOrganFilter<TInputImage, TOutputImage>::ParametersType
+RegisterOrganFilter<TInputImage, TOutputImage>::RunStarts(InternalImageType *fixedLevel, InternalImageType *movingLevel, const PyramidLevel& schedule, const ParametersType& initial) {
+    struct StartResult {
+        ParametersType parameters;
+        double value;
+        std::exception_ptr error;
+    };
+
+    // Each start gets its own optimizer, metric and interpolator; only the
+    // level images are shared, read-only. Starts run as short probes with
+    // the same sampling seed; the caller refines the winner with the full
+    // iteration count.
+    const unsigned int starts = m_NumberOfStarts;
+    const unsigned int probeIterations = std::max(1u, schedule.iterations / 10);
+    const itk::ThreadIdType threadsPerStart = std::max<itk::ThreadIdType>(1, this->GetNumberOfThreads() / starts);
+    const typename InternalImageType::RegionType baselineRegion = fixedLevel->GetBufferedRegion();
+    std::vector<StartResult> results(starts);
+    const std::string label = StageTrace::Label::Current();
+    std::vector<std::thread> workers;
+    for (unsigned int number = 0; number < starts; number++) {
+        workers.push_back(std::thread([&, number]() {
+            StageTrace::Label job(label);
+            StageTrace::Label start("start " + std::to_string(number));
+            try {
+                TransformTypePointer startTransform = TransformType::New();
+                startTransform->SetFixedParameters(transform->GetFixedParameters());
+                startTransform->SetParameters(initial);
+                PerturbStart(startTransform, number, fixedLevel);
+
+                OptimizerTypePointer startOptimizer = OptimizerType::New();
+                startOptimizer->SetMaximumStepLength(schedule.maximumStepLength);
+                startOptimizer->SetMinimumStepLength(schedule.minimumStepLength);
+                startOptimizer->SetNumberOfIterations(probeIterations);
+                startOptimizer->AddObserver(itk::IterationEvent(), optimizerObserver);
+                MetricTypePointer startMetric = CreateMetric(startOptimizer);
+                startMetric->SetNumberOfThreads(threadsPerStart);
+                SetMetricSamples(startMetric, baselineRegion);
+
+                RegistrationTypePointer startRegistration = RegistrationType::New();
+                startRegistration->SetNumberOfThreads(threadsPerStart);
+                startRegistration->SetOptimizer(startOptimizer);
+                startRegistration->SetTransform(startTransform);
+                startRegistration->SetMetric(startMetric);
+                startRegistration->SetInterpolator(InterpolatorType::New());
+                startRegistration->SetFixedImage(fixedLevel);
+                startRegistration->SetMovingImage(movingLevel);
+                startRegistration->SetFixedImageRegion(baselineRegion);
+                startRegistration->SetInitialTransformParameters(startTransform->GetParameters());
+                startRegistration->Update();
+
+                results[number].parameters = startRegistration->GetLastTransformParameters();
+            }
+            catch (...) {
+                results[number].error = std::current_exception();
+            }
+        }));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    // Rank the probes on one metric with one sample set, so the choice is
+    // not decided by each start drawing different samples
+    OptimizerTypePointer rankOptimizer = OptimizerType::New();
+    MetricTypePointer rankMetric = CreateMetric(rankOptimizer);
+    TransformTypePointer rankTransform = TransformType::New();
+    rankTransform->SetFixedParameters(transform->GetFixedParameters());
+    rankMetric->SetNumberOfThreads(this->GetNumberOfThreads());
+    SetMetricSamples(rankMetric, baselineRegion);
+    rankMetric->SetFixedImage(fixedLevel);
+    rankMetric->SetMovingImage(movingLevel);
+    rankMetric->SetTransform(rankTransform);
+    rankMetric->SetInterpolator(InterpolatorType::New());
+    rankMetric->SetFixedImageRegion(baselineRegion);
+    rankMetric->Initialize();
+
+    // Keep the best start; a start that failed is skipped unless they all did
+    const bool maximize = m_SimilarityMetric == ViolaWellsMutualInformation;
+    int best = -1;
+    for (unsigned int number = 0; number < starts; number++) {
+        if (results[number].error) {
+            continue;
+        }
+        ReseedMetric(rankMetric);
+        results[number].value = rankMetric->GetValue(results[number].parameters);
+        if (best < 0 || (maximize ? results[number].value > results[best].value : results[number].value < results[best].value)) {
+            best = static_cast<int>(number);
+        }
+    }
+    if (best < 0) {
+        std::rethrow_exception(results[0].error);
+    }
+    StageTrace::Instance().Counter("affine best start", best);
+    return results[best].parameters;
+}
+
+template <typename TInputImage, typename TOutputImage>
+void RegisterOrganFilter<TInputImage, TOutputImage>::PerturbStart(TransformType *start, unsigned int number, const InternalImageType *fixedLevel) const {
+    if (number == 0) {
+        return;
+    }
+
+    // Cycle through rotations about the slice and left-right axes and shifts
+    // along the slice and front-back axes, growing each time round
+    const unsigned int kind = (number - 1) % 8;
+    const double scale = 1.0 + (number - 1) / 8u;
+    const double angle = 0.15 * scale;
+    typename TransformType::OutputVectorType direction;
+    direction.Fill(0.0);
+    if (kind < 4) {
+        direction[kind < 2 ? 2 : 0] = 1.0;
+        start->Rotate3D(direction, kind % 2 ? -angle : angle);
+        return;
+    }
+    const unsigned int axis = kind < 6 ? 2 : 1;
+    const double extent = fixedLevel->GetLargestPossibleRegion().GetSize()[axis] * fixedLevel->GetSpacing()[axis];
+    direction[axis] = (kind % 2 ? -0.1 : 0.1) * scale * extent;
+    start->Translate(direction);
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include <iostream>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <itkImage.h>
@@ -8,7 +9,10 @@
 #include <itkAffineTransform.h>
 #include <itkRegularStepGradientDescentOptimizer.h>
 #include <itkMutualInformationImageToImageMetric.h>
-#include <itkDiscreteGaussianImageFilter.h>
+#include <itkMattesMutualInformationImageToImageMetric.h>
+#include <itkNormalizedCorrelationImageToImageMetric.h>
+#include <itkMeanSquaresImageToImageMetric.h>
+#include "GaussianSmoothingImageFilter.h"
 #include <itkImageRegistrationMethod.h>
 #include <itkNormalizeImageFilter.h>
 #include <itkResampleImageFilter.h>
@@ -19,12 +23,60 @@
 #include <itkShrinkImageFilter.h>
 #include <itkBinaryFunctorImageFilter.h>
 #include <itkImageToImageFilter.h>
+#include <itkDataObjectDecorator.h>
+#include <sstream>
+#include <thread>
+#include <exception>
+#include "RegistrationCache.h"
+#include "RoundingInterpolateImageFunction.h"
+#include "StageTrace.h"
 
 #define DIMENSION 3
 #define OUT_DIMENSION 3
 
+// Traces the affine optimizer's metric and step length at each iteration
+class OptimizerIterationTrace : public itk::Command
+{
+    public:
+    typedef  OptimizerIterationTrace                    Self;
+    typedef  itk::Command                               Superclass;
+    typedef  itk::SmartPointer<OptimizerIterationTrace> Pointer;
+
+    itkNewMacro( OptimizerIterationTrace );
+
+    protected:
+    OptimizerIterationTrace() {};
+
+    public:
+    void Execute(itk::Object *caller, const itk::EventObject & event) ITK_OVERRIDE
+    {
+        Execute((const itk::Object *)caller, event);
+    }
+
+    void Execute(const itk::Object * object, const itk::EventObject & event) ITK_OVERRIDE
+    {
+        if(!(itk::IterationEvent().CheckEvent(&event))) {
+            return;
+        }
+        const itk::RegularStepGradientDescentOptimizer * optimizer = static_cast<const itk::RegularStepGradientDescentOptimizer *>(object);
+        StageTrace &trace = StageTrace::Instance();
+        trace.Counter("affine metric", optimizer->GetValue());
+        trace.Counter("affine step length", optimizer->GetCurrentStepLength());
+    }
+};
+
+// Similarity metrics for the affine optimizer. Viola-Wells is the original
+// metric; for CT against CT the cheaper, deterministic ones usually converge
+// in fewer iterations. Declared outside the template so that one value
+// configures the filter for any pixel type.
+class RegisterOrganFilterEnums
+{
+public:
+    enum SimilarityMetricType { ViolaWellsMutualInformation, MattesMutualInformation, NormalizedCorrelation, MeanSquares };
+};
+
 template <typename TInputImage, typename TOutputImage>
-class RegisterOrganFilter : public itk::ImageToImageFilter<TInputImage, TOutputImage>
+class RegisterOrganFilter : public itk::ImageToImageFilter<TInputImage, TOutputImage>, public RegisterOrganFilterEnums
 {
 public:
     typedef RegisterOrganFilter<TInputImage, TOutputImage> Self;
@@ -33,47 +85,160 @@ public:
     typedef itk::SmartPointer<const Self> ConstPointer;
     typedef TInputImage ImageType;
     typedef typename ImageType::PixelType PixelType;
+    typedef itk::AffineTransform<double, DIMENSION> TransformType;
+
+    // The final transform as a pipeline output, so a downstream filter that
+    // takes it updates the registration first
+    typedef itk::Transform<double, DIMENSION, DIMENSION> TransformBaseType;
+    typedef itk::DataObjectDecorator<TransformBaseType> TransformOutputType;
+
+    // The pyramid, metric and optimizer work in float whatever the input
+    // pixel type, so integer CT only becomes float at the downsampled levels
+    typedef itk::Image<float, TInputImage::ImageDimension> InternalImageType;
 
     itkNewMacro(Self);
 
+    itkSetMacro(SimilarityMetric, SimilarityMetricType);
+    itkGetMacro(SimilarityMetric, SimilarityMetricType);
+
+    // Seed for metrics that sample voxels, so repeated runs agree
+    itkSetMacro(RandomSeed, int);
+    itkGetMacro(RandomSeed, int);
+
+    // Number of starting poses tried concurrently at the coarsest level. The
+    // moments-based pose is always one of them; the others are rotated or
+    // shifted copies of it. Each runs a tenth of the level's iterations, and
+    // only the best then runs the full schedule.
+    itkSetClampMacro(NumberOfStarts, unsigned int, 1, 64);
+    itkGetMacro(NumberOfStarts, unsigned int);
+
+    // When off, only the transform is estimated and the output is left empty,
+    // e.g. when a later stage resamples with a composed transform
+    itkSetMacro(ResampleMovingImage, bool);
+    itkGetMacro(ResampleMovingImage, bool);
+    itkBooleanMacro(ResampleMovingImage);
+
+    // Smooth with the recursive Gaussian, whose cost does not depend on the variance
+    itkSetMacro(UseRecursiveGaussian, bool);
+    itkGetMacro(UseRecursiveGaussian, bool);
+    itkBooleanMacro(UseRecursiveGaussian);
+
+    // Directory for cached transforms; empty disables the cache
+    itkSetStringMacro(CacheDirectory);
+    itkGetStringMacro(CacheDirectory);
+
+    // Free each level's intermediate images once the next filter has used
+    // them, and drop every internal reference to the inputs when a run ends.
+    // The prepared fixed levels are still kept.
+    itkSetMacro(ReleaseIntermediateData, bool);
+    itkGetMacro(ReleaseIntermediateData, bool);
+    itkBooleanMacro(ReleaseIntermediateData);
+
     RegisterOrganFilter();
     ~RegisterOrganFilter();
     void GenerateData();
-    void RegisterOrganFilter<TInputImage, TOutputImage>::SetFixedImage(const TInputImage *image);
+    void SetFixedImage(const ImageType *image);
     void SetMovingImage(const ImageType *image);
     const ImageType* GetFixedImage();
     const ImageType* GetMovingImage();
+    const TransformType* GetFinalTransform() const;
+    const TransformOutputType* GetTransformOutput() const;
+
+    // Coarse-to-fine schedule. Each level is seeded with the previous level's transform.
+    void AddPyramidLevel(unsigned int shrinkFactor, unsigned int iterations, double maximumStepLength, double minimumStepLength);
+    void ClearPyramidLevels();
+    unsigned int GetNumberOfPyramidLevels() const;
 
 protected:
+    typedef itk::ProcessObject::DataObjectPointer DataObjectPointer;
+    typedef itk::ProcessObject::DataObjectPointerArraySizeType DataObjectPointerArraySizeType;
+
+    // Output 1 is the transform decorator
+    using Superclass::MakeOutput;
+    DataObjectPointer MakeOutput(DataObjectPointerArraySizeType index) ITK_OVERRIDE;
+
+    // Fixed and moving scans need not share a grid
+    void VerifyInputInformation() {}
+
+    // The transform is estimated from both whole images; the resample only
+    // writes the requested output region, so the output can be streamed
+    void GenerateInputRequestedRegion();
+
+    // True if the final transform was estimated after the inputs and settings last changed
+    bool TransformIsCurrent() const;
+
     // Define types
-    typedef itk::AffineTransform<double, DIMENSION> TransformType;
     typedef typename TransformType::Pointer TransformTypePointer;
     typedef itk::RegularStepGradientDescentOptimizer OptimizerType;
     typedef typename OptimizerType::Pointer OptimizerTypePointer;
-    typedef itk::LinearInterpolateImageFunction<TInputImage, double>  InterpolatorType;
+    typedef itk::LinearInterpolateImageFunction<InternalImageType, double>  InterpolatorType;
     typedef typename InterpolatorType::Pointer InterpolatorTypePointer;
-    typedef itk::ImageRegistrationMethod<TInputImage, TInputImage>  RegistrationType;
+    typedef itk::ImageRegistrationMethod<InternalImageType, InternalImageType>  RegistrationType;
     typedef typename RegistrationType::Pointer RegistrationTypePointer;
-    typedef itk::MutualInformationImageToImageMetric<TInputImage, TInputImage> MetricType;
+    typedef itk::ImageToImageMetric<InternalImageType, InternalImageType> MetricType;
     typedef typename MetricType::Pointer MetricTypePointer;
-    typedef itk::NormalizeImageFilter<TInputImage, TInputImage> NormalizeType;
+    typedef itk::MutualInformationImageToImageMetric<InternalImageType, InternalImageType> ViolaWellsMetricType;
+    typedef itk::MattesMutualInformationImageToImageMetric<InternalImageType, InternalImageType> MattesMetricType;
+    typedef itk::NormalizedCorrelationImageToImageMetric<InternalImageType, InternalImageType> CorrelationMetricType;
+    typedef itk::MeanSquaresImageToImageMetric<InternalImageType, InternalImageType> MeanSquaresMetricType;
+    typedef itk::NormalizeImageFilter<InternalImageType, InternalImageType> NormalizeType;
     typedef typename NormalizeType::Pointer NormalizeTypePointer;
-    typedef itk::DiscreteGaussianImageFilter<TInputImage, TInputImage> GaussianFilterType;
+    typedef GaussianSmoothingImageFilter<InternalImageType, InternalImageType> GaussianFilterType;
     typedef typename GaussianFilterType::Pointer GaussianFilterTypePointer;
     typedef itk::ResampleImageFilter<TInputImage, TOutputImage> ResampleFilterType;
     typedef typename ResampleFilterType::Pointer ResampleFilterTypePointer;
+    typedef RoundingInterpolateImageFunction<TInputImage, typename TOutputImage::PixelType> ResampleInterpolatorType;
     typedef itk::CenteredTransformInitializer<TransformType, TInputImage, TInputImage> TransformInitializerType;
     typedef typename TransformInitializerType::Pointer TransformInitializerTypePointer;
-    typedef itk::ShrinkImageFilter<TInputImage, TInputImage> DownsampleType;
+    typedef itk::ShrinkImageFilter<TInputImage, InternalImageType> DownsampleType;
     typedef typename DownsampleType::Pointer DownsampleTypePointer;
 
+    struct PyramidLevel {
+        unsigned int shrinkFactor;
+        unsigned int iterations;
+        double maximumStepLength;
+        double minimumStepLength;
+    };
+
+    // (Re)create the internal filters that hold images between runs
+    void CreateInternalFilters();
+
+    // Load the final transform from the cache or estimate it
+    void UpdateFinalTransform(ImageType *fixed, ImageType *moving);
+
+    // Run the pyramid schedule and store the result in finalTransform
+    void EstimateTransform(ImageType *fixed, ImageType *moving);
+
+    // Settings that the preprocessed fixed levels depend on
+    std::string FixedLevelSettings() const;
+
+    typedef typename RegistrationType::ParametersType ParametersType;
+
+    // Create the configured metric and point the optimizer the right way
+    MetricTypePointer CreateMetric(OptimizerType *target) const;
+
+    // Whether the metric draws random samples, so RandomSeed affects the result
+    bool MetricSamplesRandomly() const;
+
+    // Restart the metric's sampling from RandomSeed; no-op for metrics that do not sample
+    void ReseedMetric(MetricType *target) const;
+
+    // Number of voxels sampled per evaluation for a fixed region
+    void SetMetricSamples(MetricType *target, const typename InternalImageType::RegionType& region) const;
+
+    // Probe every start on one level concurrently and return the best probe's result
+    ParametersType RunStarts(InternalImageType *fixedLevel, InternalImageType *movingLevel, const PyramidLevel& schedule, const ParametersType& initial);
+
+    // Rotate or shift a start's transform by the perturbation for this start number
+    void PerturbStart(TransformType *start, unsigned int number, const InternalImageType *fixedLevel) const;
+
 private:
     // Downsample the images to make registration faster
-    // TODO: Replace this with a resample filter to 128x128
     DownsampleTypePointer downsampleBaseline;
     DownsampleTypePointer downsampleLater;
     TransformTypePointer transform;
     OptimizerTypePointer optimizer;
+    OptimizerIterationTrace::Pointer optimizerObserver;
     InterpolatorTypePointer interpolator;
     RegistrationTypePointer registration;
     MetricTypePointer metric;
@@ -83,5 +248,23 @@ private:
     GaussianFilterTypePointer laterGaussianFilter;
     TransformInitializerTypePointer transformInitializer;
     TransformTypePointer finalTransform;
+    itk::TimeStamp m_FinalTransformTime;
     ResampleFilterTypePointer resample;
+    std::vector<PyramidLevel> m_PyramidLevels;
+
+    // Downsampled, normalized and smoothed fixed image for each level. Kept
+    // while the fixed input and settings stay the same, so registering
+    // several moving images against one fixed image prepares it only once.
+    std::vector<typename InternalImageType::Pointer> m_FixedLevels;
+    const ImageType *m_FixedLevelsSource;
+    itk::ModifiedTimeType m_FixedLevelsTime;
+    std::string m_FixedLevelsSettings;
+
+    std::string m_CacheDirectory;
+    bool m_ResampleMovingImage;
+    bool m_UseRecursiveGaussian;
+    bool m_ReleaseIntermediateData;
+    SimilarityMetricType m_SimilarityMetric;
+    int m_RandomSeed;
+    unsigned int m_NumberOfStarts;
 };
\ No newline at end of file
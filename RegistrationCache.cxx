@@ -0,0 +1,171 @@
+#include "RegistrationCache.h"
+#include "AtomicFile.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <itkImageFileReader.h>
+#include <itkImageFileWriter.h>
+#include <itksys/SystemTools.hxx>
+
+template <typename TImage>
+RegistrationCache<TImage>::RegistrationCache(const std::string &directory)
+{
+    m_Directory = directory;
+    itksys::SystemTools::MakeDirectory(m_Directory.c_str());
+}
+
+template <typename TImage>
+RegistrationCache<TImage>::~RegistrationCache()
+{
+    //
+}
+
+template <typename TImage>
+std::string RegistrationCache<TImage>::MakeKey(const ImageType *fixed, const ImageType *moving, const std::string &settings) const {
+    unsigned long long hash = 14695981039346656037ULL;
+    HashImage(fixed, hash);
+    HashImage(moving, hash);
+    HashBytes(settings.data(), settings.size(), hash);
+    hash = Mix(hash);
+
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", hash);
+    return key;
+}
+
+template <typename TImage>
+bool RegistrationCache<TImage>::LoadParameters(const std::string &key, ParametersType &parameters, ParametersType &fixedParameters) const {
+    std::ifstream file((m_Directory + "/" + key + ".transform").c_str());
+    unsigned int count = 0;
+    if (!(file >> count)) {
+        return false;
+    }
+    parameters.SetSize(count);
+    for (unsigned int i = 0; i < count; i++) {
+        file >> parameters[i];
+    }
+    if (!(file >> count)) {
+        return false;
+    }
+    fixedParameters.SetSize(count);
+    for (unsigned int i = 0; i < count; i++) {
+        file >> fixedParameters[i];
+    }
+    return !file.fail();
+}
+
+template <typename TImage>
+bool RegistrationCache<TImage>::StoreParameters(const std::string &key, const ParametersType &parameters, const ParametersType &fixedParameters) const {
+    // Written under a temporary name and renamed, so a crash or a concurrent
+    // reader never sees a truncated parameter list
+    const std::string path = m_Directory + "/" + key + ".transform";
+    const std::string temporary = AtomicFile::TemporaryName(path);
+    std::ofstream file(temporary.c_str());
+    file << std::setprecision(17);
+    file << parameters.GetSize();
+    for (unsigned int i = 0; i < parameters.GetSize(); i++) {
+        file << ' ' << parameters[i];
+    }
+    file << '\n' << fixedParameters.GetSize();
+    for (unsigned int i = 0; i < fixedParameters.GetSize(); i++) {
+        file << ' ' << fixedParameters[i];
+    }
+    file << '\n';
+    file.close();
+    if (file.fail()) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return AtomicFile::Commit(temporary, path);
+}
+
+template <typename TImage>
+template <typename TField>
+typename TField::Pointer RegistrationCache<TImage>::LoadField(const std::string &key) const {
+    const std::string path = m_Directory + "/" + key + ".mha";
+    if (!itksys::SystemTools::FileExists(path.c_str())) {
+        return typename TField::Pointer();
+    }
+
+    typedef itk::ImageFileReader<TField> ReaderType;
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName(path);
+    try {
+        reader->Update();
+    }
+    catch (itk::ExceptionObject &) {
+        return typename TField::Pointer();
+    }
+    typename TField::Pointer field = reader->GetOutput();
+    field->DisconnectPipeline();
+    return field;
+}
+
+template <typename TImage>
+template <typename TField>
+bool RegistrationCache<TImage>::StoreField(const std::string &key, const TField *field) const {
+    // The temporary keeps the .mha extension so the writer picks MetaImage
+    const std::string path = m_Directory + "/" + key + ".mha";
+    const std::string temporary = AtomicFile::TemporaryName(path) + ".mha";
+    typedef itk::ImageFileWriter<TField> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName(temporary);
+    writer->SetInput(field);
+    try {
+        writer->Update();
+    }
+    catch (itk::ExceptionObject &) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return AtomicFile::Commit(temporary, path);
+}
+
+template <typename TImage>
+unsigned long long RegistrationCache<TImage>::Mix(unsigned long long x) {
+    // splitmix64 finalizer: a bijection where every input bit reaches every output bit
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+template <typename TImage>
+void RegistrationCache<TImage>::HashBytes(const void *data, size_t length, unsigned long long &hash) const {
+    // Fold in 64-bit words, mixing the state fully after each one so that no
+    // change can cancel out against a change in a later word. The tail is
+    // packed into a last word together with the length.
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    size_t i = 0;
+    for (; i + sizeof(unsigned long long) <= length; i += sizeof(unsigned long long)) {
+        unsigned long long word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        hash = Mix(hash ^ word);
+    }
+    unsigned long long tail = 0;
+    std::memcpy(&tail, bytes + i, length - i);
+    hash = Mix(hash ^ tail);
+    hash = Mix(hash ^ static_cast<unsigned long long>(length));
+}
+
+template <typename TImage>
+void RegistrationCache<TImage>::HashImage(const ImageType *image, unsigned long long &hash) const {
+    const unsigned int dimension = ImageType::ImageDimension;
+    const typename ImageType::RegionType& region = image->GetBufferedRegion();
+    for (unsigned int d = 0; d < dimension; d++) {
+        const unsigned long long size = region.GetSize()[d];
+        const double spacing = image->GetSpacing()[d];
+        const double origin = image->GetOrigin()[d];
+        HashBytes(&size, sizeof(size), hash);
+        HashBytes(&spacing, sizeof(spacing), hash);
+        HashBytes(&origin, sizeof(origin), hash);
+        for (unsigned int e = 0; e < dimension; e++) {
+            const double direction = image->GetDirection()[d][e];
+            HashBytes(&direction, sizeof(direction), hash);
+        }
+    }
+    HashBytes(image->GetBufferPointer(), region.GetNumberOfPixels() * sizeof(typename ImageType::PixelType), hash);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <string>
+#include <itkImage.h>
+#include <itkOptimizerParameters.h>
+
+// On-disk cache of registration results. Keys hash the content and geometry
+// of both input volumes together with a description of the registration
+// settings, so a result is only reused for identical inputs.
+template <typename TImage>
+class RegistrationCache
+{
+public:
+    typedef TImage ImageType;
+    typedef itk::OptimizerParameters<double> ParametersType;
+
+    RegistrationCache(const std::string &directory);
+    ~RegistrationCache();
+
+    std::string MakeKey(const ImageType *fixed, const ImageType *moving, const std::string &settings) const;
+
+    // Affine (or any itk::Transform) parameters, stored as text
+    bool LoadParameters(const std::string &key, ParametersType &parameters, ParametersType &fixedParameters) const;
+    bool StoreParameters(const std::string &key, const ParametersType &parameters, const ParametersType &fixedParameters) const;
+
+    // Displacement fields, stored as MetaImage; returns a null pointer when missing
+    template <typename TField>
+    typename TField::Pointer LoadField(const std::string &key) const;
+    template <typename TField>
+    bool StoreField(const std::string &key, const TField *field) const;
+
+protected:
+    static unsigned long long Mix(unsigned long long x);
+    void HashBytes(const void *data, size_t length, unsigned long long &hash) const;
+    void HashImage(const ImageType *image, unsigned long long &hash) const;
+
+private:
+    std::string m_Directory;
+};
@@ -0,0 +1,30 @@
+#include "RoundingInterpolateImageFunction.h"
+#include <algorithm>
+#include <limits>
+#include <itkLinearInterpolateImageFunction.h>
+#include <itkMath.h>
+#include <itkNumericTraits.h>
+
+template <typename TInputImage, typename TOutputPixel, typename TCoordRep>
+RoundingInterpolateImageFunction<TInputImage, TOutputPixel, TCoordRep>::RoundingInterpolateImageFunction()
+{
+    m_Interpolator = itk::LinearInterpolateImageFunction<TInputImage, TCoordRep>::New();
+}
+
+template <typename TInputImage, typename TOutputPixel, typename TCoordRep>
+void RoundingInterpolateImageFunction<TInputImage, TOutputPixel, TCoordRep>::SetInputImage(const InputImageType *image) {
+    Superclass::SetInputImage(image);
+    m_Interpolator->SetInputImage(image);
+}
+
+template <typename TInputImage, typename TOutputPixel, typename TCoordRep>
+typename RoundingInterpolateImageFunction<TInputImage, TOutputPixel, TCoordRep>::OutputType
+RoundingInterpolateImageFunction<TInputImage, TOutputPixel, TCoordRep>::EvaluateAtContinuousIndex(const ContinuousIndexType &index) const {
+    const OutputType value = m_Interpolator->EvaluateAtContinuousIndex(index);
+    if (!std::numeric_limits<TOutputPixel>::is_integer) {
+        return value;
+    }
+    const OutputType lowest = static_cast<OutputType>(itk::NumericTraits<TOutputPixel>::NonpositiveMin());
+    const OutputType highest = static_cast<OutputType>(itk::NumericTraits<TOutputPixel>::max());
+    return static_cast<OutputType>(itk::Math::Round<long long>(std::min(highest, std::max(lowest, value))));
+}
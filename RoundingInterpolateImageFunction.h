@@ -0,0 +1,39 @@
+#pragma once
+#include <itkInterpolateImageFunction.h>
+
+// Wraps another interpolator and, for an integer output pixel type, rounds
+// its values to the nearest integer within the pixel type's range.
+// ResampleImageFilter and WarpImageFilter convert interpolated values with a
+// plain cast, which truncates towards zero and so biases int16 CT output by
+// up to one unit; with this wrapper the cast only sees whole numbers. For
+// floating point output values pass through unchanged.
+template <typename TInputImage, typename TOutputPixel, typename TCoordRep = double>
+class RoundingInterpolateImageFunction : public itk::InterpolateImageFunction<TInputImage, TCoordRep>
+{
+public:
+    typedef RoundingInterpolateImageFunction<TInputImage, TOutputPixel, TCoordRep> Self;
+    typedef itk::InterpolateImageFunction<TInputImage, TCoordRep> Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    typedef itk::SmartPointer<const Self> ConstPointer;
+    typedef typename Superclass::InputImageType InputImageType;
+    typedef typename Superclass::OutputType OutputType;
+    typedef typename Superclass::ContinuousIndexType ContinuousIndexType;
+    typedef Superclass InterpolatorType;
+
+    itkNewMacro(Self);
+    itkTypeMacro(RoundingInterpolateImageFunction, InterpolateImageFunction);
+
+    // The interpolator whose values are rounded
+    itkSetObjectMacro(Interpolator, InterpolatorType);
+    itkGetConstObjectMacro(Interpolator, InterpolatorType);
+
+    void SetInputImage(const InputImageType *image) ITK_OVERRIDE;
+    OutputType EvaluateAtContinuousIndex(const ContinuousIndexType &index) const ITK_OVERRIDE;
+
+protected:
+    RoundingInterpolateImageFunction();
+    ~RoundingInterpolateImageFunction() {}
+
+private:
+    typename InterpolatorType::Pointer m_Interpolator;
+};
@@ -1,16 +1,73 @@
 #include "SegmentLungVolume.h"
+#include "DistanceMorphologyImageFilter.cxx"
+#include "GaussianSmoothingImageFilter.cxx"
 
 template <typename TInputImage, typename TOutputImage>
 SegmentLungVolume<TInputImage, TOutputImage>::SegmentLungVolume() {
+	CreateInternalFilters();
+	invertFilter = InvertFilterType::New();
+	m_Threshold = 0;
+	m_Variance = 0.0;
+	m_Radius = 3;
+	m_UseFastMorphology = false;
+	m_UseRecursiveGaussian = false;
+	m_ReleaseIntermediateData = false;
+}
+
+template <typename TInputImage, typename TOutputImage> 
+SegmentLungVolume<TInputImage, TOutputImage>::~SegmentLungVolume() {
+}
+
+template <typename TInputImage, typename TOutputImage>
+void SegmentLungVolume<TInputImage, TOutputImage>::CreateInternalFilters() {
 	gaussianFilter = FilterType::New();
 	thresholdFilter = ThresholdImageFilterType::New();
-	invertFilter = InvertFilterType::New();
 	openingFilter = OpeningFilterType::New();
 	closingFilter = ClosingFilterType::New();
+	fastClosingFilter = FastMorphologyFilterType::New();
+	fastOpeningFilter = FastMorphologyFilterType::New();
+	castFilter = CastFilterType::New();
 }
 
-template <typename TInputImage, typename TOutputImage> 
-SegmentLungVolume<TInputImage, TOutputImage>::~SegmentLungVolume() {
+template <typename TInputImage, typename TOutputImage>
+bool SegmentLungVolume<TInputImage, TOutputImage>::NeedsWholeImage() const {
+	return m_UseFastMorphology || (m_Variance > 0 && m_UseRecursiveGaussian);
+}
+
+template <typename TInputImage, typename TOutputImage>
+void SegmentLungVolume<TInputImage, TOutputImage>::GenerateInputRequestedRegion() {
+	SuperClass::GenerateInputRequestedRegion();
+	ImageType *input = const_cast<ImageType *>(this->GetInput());
+	if (!input) {
+		return;
+	}
+	if (NeedsWholeImage()) {
+		input->SetRequestedRegionToLargestPossibleRegion();
+		return;
+	}
+
+	// The closing and the opening each dilate and erode by the radius, on
+	// top of the smoothing kernel
+	typename ImageType::SizeType halo;
+	halo.Fill(4 * m_Radius);
+	if (m_Variance > 0) {
+		const typename ImageType::SizeType kernel = FilterType::KernelRadius(m_Variance, input->GetSpacing());
+		for (unsigned int d = 0; d < ImageType::ImageDimension; d++) {
+			halo[d] += kernel[d];
+		}
+	}
+	typename ImageType::RegionType region = this->GetOutput()->GetRequestedRegion();
+	region.PadByRadius(halo);
+	region.Crop(input->GetLargestPossibleRegion());
+	input->SetRequestedRegion(region);
+}
+
+template <typename TInputImage, typename TOutputImage>
+void SegmentLungVolume<TInputImage, TOutputImage>::EnlargeOutputRequestedRegion(itk::DataObject *output) {
+	SuperClass::EnlargeOutputRequestedRegion(output);
+	if (NeedsWholeImage()) {
+		output->SetRequestedRegionToLargestPossibleRegion();
+	}
 }
 
 template <typename TInputImage, typename TOutputImage> 
@@ -18,41 +75,79 @@ void SegmentLungVolume<TInputImage, TOutputImage>::GenerateData() {
 	typename ImageType::Pointer img = ImageType::New();
 	img->Graft(this->GetInput());
 
+	// Internal filters share this filter's thread count
+	const itk::ThreadIdType threads = this->GetNumberOfThreads();
+	gaussianFilter->SetNumberOfThreads(threads);
+	thresholdFilter->SetNumberOfThreads(threads);
+	closingFilter->SetNumberOfThreads(threads);
+	openingFilter->SetNumberOfThreads(threads);
+	fastClosingFilter->SetNumberOfThreads(threads);
+	fastOpeningFilter->SetNumberOfThreads(threads);
+	castFilter->SetNumberOfThreads(threads);
+
+	// Every stage has a single consumer
+	gaussianFilter->SetReleaseDataFlag(m_ReleaseIntermediateData);
+	thresholdFilter->SetReleaseDataFlag(m_ReleaseIntermediateData);
+	closingFilter->SetReleaseDataFlag(m_ReleaseIntermediateData);
+	openingFilter->SetReleaseDataFlag(m_ReleaseIntermediateData);
+	fastClosingFilter->SetReleaseDataFlag(m_ReleaseIntermediateData);
+	fastOpeningFilter->SetReleaseDataFlag(m_ReleaseIntermediateData);
+
+	// Nothing else reads the opened mask, so with a uint8 output the cast
+	// hands its buffer on instead of copying it
+	castFilter->InPlaceOn();
+
 	// Create and setup a Gaussian filter
 	gaussianFilter->SetInput(img);
 	gaussianFilter->SetVariance(this->GetVariance());
+	gaussianFilter->SetUseRecursive(m_UseRecursiveGaussian);
 
-	// Threshold
-	thresholdFilter->SetInput(img);
+	// Threshold into a compact mask
+	if (this->GetVariance() > 0) {
+		thresholdFilter->SetInput(gaussianFilter->GetOutput());
+	}
+	else {
+		thresholdFilter->SetInput(img);
+	}
 	thresholdFilter->SetLowerThreshold(0);
 	thresholdFilter->SetUpperThreshold(this->GetThreshold());
+	thresholdFilter->SetInsideValue(255);
 	thresholdFilter->SetOutsideValue(0);
-	thresholdFilter->Update();
-
-	// Structuring
-	structureFilter.SetRadius(3);
-	structureFilter.CreateStructuringElement();
-
-	// Closing
-	closingFilter->SetInput(thresholdFilter->GetOutput());
-	closingFilter->SetKernel(structureFilter);
-
-	// Opening
-	openingFilter->SetInput(closingFilter->GetOutput());
-	openingFilter->SetKernel(structureFilter);
-	openingFilter->Update();
-
-    // Convert to output type
-    typedef itk::CastImageFilter< TInputImage, TOutputImage > CastFilterType;
-    CastFilterType::Pointer castFilter = CastFilterType::New();
-    castFilter->SetInput(openingFilter->GetOutput());
-
-    /*
-	openingFilter->GraftOutput(this->GetOutput());
-	openingFilter->Update();
-	this->GraftOutput(openingFilter->GetOutput());
-    */
+
+	if (m_UseFastMorphology) {
+		// Closing then opening
+		fastClosingFilter->SetInput(thresholdFilter->GetOutput());
+		fastClosingFilter->SetOperation(FastMorphologyFilterType::Close);
+		fastClosingFilter->SetRadius(m_Radius);
+		fastClosingFilter->SetForegroundValue(255);
+		fastOpeningFilter->SetInput(fastClosingFilter->GetOutput());
+		fastOpeningFilter->SetOperation(FastMorphologyFilterType::Open);
+		fastOpeningFilter->SetRadius(m_Radius);
+		fastOpeningFilter->SetForegroundValue(255);
+		castFilter->SetInput(fastOpeningFilter->GetOutput());
+	}
+	else {
+		// Structuring
+		structureFilter.SetRadius(m_Radius);
+		structureFilter.CreateStructuringElement();
+
+		// Closing
+		closingFilter->SetInput(thresholdFilter->GetOutput());
+		closingFilter->SetKernel(structureFilter);
+		closingFilter->SetForegroundValue(255);
+
+		// Opening
+		openingFilter->SetInput(closingFilter->GetOutput());
+		openingFilter->SetKernel(structureFilter);
+		openingFilter->SetForegroundValue(255);
+		castFilter->SetInput(openingFilter->GetOutput());
+	}
+
+	// Convert to output type
 	castFilter->GraftOutput(this->GetOutput());
 	castFilter->Update();
 	this->GraftOutput(castFilter->GetOutput());
+	if (m_ReleaseIntermediateData) {
+		CreateInternalFilters();
+	}
 }
\ No newline at end of file
@@ -1,16 +1,26 @@
 #pragma once
 #include "itkImage.h"
 #include "itkImageFileReader.h"
-#include "itkDiscreteGaussianImageFilter.h"
+#include "GaussianSmoothingImageFilter.h"
 #include "itkBinaryThresholdImageFilter.h"
 #include "itkInvertIntensityImageFilter.h"
 #include "itkBinaryMorphologicalOpeningImageFilter.h"
 #include "itkBinaryMorphologicalClosingImageFilter.h"
 #include "itkBinaryBallStructuringElement.h"
-#include "QuickView.h"
+#include "itkCastImageFilter.h"
+#include "DistanceMorphologyImageFilter.h"
 
 #define DIMENSION 3
 
+// Segments the lungs by smoothing with the configured variance (0 skips it),
+// thresholding and cleaning up the result with a closing and an opening. The
+// mask is built as uint8 (0 or 255) internally; use an unsigned char output
+// image to keep it compact, any other output type gets a cast copy.
+// With the discrete Gaussian and structuring-element morphology the filter
+// streams: each output region reads its input padded by the smoothing and
+// morphology halo. The recursive Gaussian and distance morphology need the
+// whole image.
+
 template<typename TInputImage, typename TOutputImage> 
 class SegmentLungVolume : public itk::ImageToImageFilter<TInputImage, TOutputImage> {
 public: 
@@ -25,6 +35,26 @@ public:
 	itkSetMacro(Variance, float);
 	itkGetMacro(Threshold, int);
 	itkGetMacro(Variance, float);
+	itkSetMacro(Radius, unsigned int);
+	itkGetMacro(Radius, unsigned int);
+
+	// Close and open with distance transforms instead of structuring
+	// elements, so the cost does not grow with the radius
+	itkSetMacro(UseFastMorphology, bool);
+	itkGetMacro(UseFastMorphology, bool);
+	itkBooleanMacro(UseFastMorphology);
+
+	// Smooth with the recursive Gaussian, whose cost does not depend on the variance
+	itkSetMacro(UseRecursiveGaussian, bool);
+	itkGetMacro(UseRecursiveGaussian, bool);
+	itkBooleanMacro(UseRecursiveGaussian);
+
+	// Free the smoothed image and each mask stage as soon as the next stage
+	// has read it, cast the mask in place, and drop the internal filters'
+	// references to the input when a run ends
+	itkSetMacro(ReleaseIntermediateData, bool);
+	itkGetMacro(ReleaseIntermediateData, bool);
+	itkBooleanMacro(ReleaseIntermediateData);
 
 	SegmentLungVolume();
 	~SegmentLungVolume();
@@ -32,22 +62,35 @@ public:
 	void GenerateData();
 	
 protected: 
+	void GenerateInputRequestedRegion();
+	void EnlargeOutputRequestedRegion(itk::DataObject *output);
+
+	// True when some stage needs the whole image whatever the output region
+	bool NeedsWholeImage() const;
+
 	typedef itk::Image< unsigned short, DIMENSION > OutputType;
-	typedef itk::Image< unsigned char, DIMENSION > UnsignedCharImageType;
+	typedef itk::Image< unsigned char, TInputImage::ImageDimension > UnsignedCharImageType;
 	typedef itk::Image< float, DIMENSION >         FloatImageType;
 	
-	typedef itk::DiscreteGaussianImageFilter<TInputImage, TInputImage >  FilterType;
-	typedef itk::BinaryThresholdImageFilter <TInputImage, TInputImage> ThresholdImageFilterType;
+	typedef GaussianSmoothingImageFilter<TInputImage, TInputImage >  FilterType;
+	typedef itk::BinaryThresholdImageFilter <TInputImage, UnsignedCharImageType> ThresholdImageFilterType;
 	typedef itk::InvertIntensityImageFilter<TInputImage> InvertFilterType;
-	typedef itk::BinaryBallStructuringElement<PixelType, DIMENSION> StructureFilterType;
-	typedef itk::BinaryMorphologicalOpeningImageFilter<TInputImage, TInputImage, StructureFilterType> OpeningFilterType;
-	typedef itk::BinaryMorphologicalClosingImageFilter<TInputImage, TInputImage, StructureFilterType> ClosingFilterType;
+	typedef itk::BinaryBallStructuringElement<unsigned char, TInputImage::ImageDimension> StructureFilterType;
+	typedef itk::BinaryMorphologicalOpeningImageFilter<UnsignedCharImageType, UnsignedCharImageType, StructureFilterType> OpeningFilterType;
+	typedef itk::BinaryMorphologicalClosingImageFilter<UnsignedCharImageType, UnsignedCharImageType, StructureFilterType> ClosingFilterType;
+	typedef DistanceMorphologyImageFilter<UnsignedCharImageType> FastMorphologyFilterType;
+	typedef itk::CastImageFilter<UnsignedCharImageType, TOutputImage> CastFilterType;
 	
 	typedef typename FilterType::Pointer FilterTypePointer;
 	typedef typename ThresholdImageFilterType::Pointer ThresholdImageFilterTypePointer;
 	typedef typename InvertFilterType::Pointer InvertIntensityImageFilterPointer;
 	typedef typename OpeningFilterType::Pointer OpeningFilterPointer;
 	typedef typename ClosingFilterType::Pointer ClosingFilterPointer;
+	typedef typename FastMorphologyFilterType::Pointer FastMorphologyFilterPointer;
+	typedef typename CastFilterType::Pointer CastFilterPointer;
+
+	// (Re)create the internal filters that hold images between runs
+	void CreateInternalFilters();
 	
 private:
 	FilterTypePointer gaussianFilter;
@@ -56,7 +99,14 @@ private:
 	OpeningFilterPointer openingFilter;
 	ClosingFilterPointer closingFilter;
 	StructureFilterType structureFilter;
+	FastMorphologyFilterPointer fastClosingFilter;
+	FastMorphologyFilterPointer fastOpeningFilter;
+	CastFilterPointer castFilter;
 	int m_Threshold;
 	float m_Variance;
 	int m_invert;
+	unsigned int m_Radius;
+	bool m_UseFastMorphology;
+	bool m_UseRecursiveGaussian;
+	bool m_ReleaseIntermediateData;
 };
\ No newline at end of file
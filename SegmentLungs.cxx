@@ -1,105 +1,150 @@
-#include "SegmentLungVolume.cxx"
 #include "SegmentLungVolume.h"
-#include "itkImage.h"
-#include "itkImageFileReader.h"
-#include "itkDiscreteGaussianImageFilter.h"
-#include "itkThresholdImageFilter.h"
-#include "QuickView.h"
-#include "itkMaskImageFilter.h"
-#include "itkMaskNegatedImageFilter.h"
-#include "itkAddImageFilter.h"
-#include "itkBinaryFillholeImageFilter.h"
-#include "itkInvertIntensityImageFilter.h"
-
-int main(int argc, char *argv[]) {
-	// Parse command line argumentsa
-	std::string inputFilename = argv[1];
-	int threshold = 50;
-	double variance = 2.0;
-	int invert = 255;
-	if (argc > 2)
-	{
-		variance = atof(argv[2]);
-		threshold = atoi(argv[3]);
-	}
-
-	// Setup types
-	typedef itk::Image< unsigned char, 2 > UnsignedCharImageType;
-	typedef itk::Image< float, 2 >         FloatImageType;
-	typedef itk::Image< unsigned char, 2 >         MaskType;
+#include "SegmentLungVolume.cxx"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <itkImage.h>
+#include <itkImageFileReader.h>
+#include <itkImageFileWriter.h>
+#include <itkNumericSeriesFileNames.h>
 
-	typedef itk::ImageFileReader< FloatImageType >  readerType;
+typedef itk::Image<float, 2> FloatImageType;
+typedef itk::Image<unsigned char, 2> MaskType;
+typedef SegmentLungVolume<FloatImageType, MaskType> SegmentFilterType;
 
-	typedef itk::DiscreteGaussianImageFilter<FloatImageType, FloatImageType >  filterType;
+struct SegmentOptions {
+    int threshold = 50;
+    double variance = 2.0;
+    unsigned int radius = 0;
+    bool useFastMorphology = false;
+    bool useRecursiveGaussian = false;
+    unsigned int jobs = std::max(1u, std::thread::hardware_concurrency());
+};
 
-	// Create and setup a reader
-	readerType::Pointer reader = readerType::New();
-	reader->SetFileName(argv[1]);
+void PrintUsage() {
+    std::cout << "USAGE: " << std::endl;
+    std::cout << "SegmentLungs.exe <Input Path Template> <Start Index> <End Index> <Output Path Template> [Options]" << std::endl;
+    std::cout << "Input Path Template -- A standardized file name/path for each numbered 2D slice" << std::endl;
+    std::cout << "      with \"%d\" standing in for the number, such as \"C:\\foo %d.tif\"." << std::endl;
+    std::cout << "Output Path Template -- Where each slice's lung mask (0 or 255) is written, e.g. \"C:\\mask %d.png\"." << std::endl << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "--threshold <Value> -- Upper intensity of lung tissue after smoothing (default 50)." << std::endl;
+    std::cout << "--variance <Value> -- Gaussian smoothing variance in physical units; 0 skips smoothing (default 2)." << std::endl;
+    std::cout << "--radius <Voxels> -- Closing and opening radius; 0 keeps the filter's default." << std::endl;
+    std::cout << "--fast-morphology -- Clean up the masks with distance transforms instead of structuring elements." << std::endl;
+    std::cout << "--recursive-gaussian -- Smooth with a recursive Gaussian whose cost does not grow with the variance." << std::endl;
+    std::cout << "--jobs <Count> -- Slices segmented at the same time (default: one per core)." << std::endl;
+}
 
-	SegmentLungVolume<FloatImageType, FloatImageType>::Pointer comp = SegmentLungVolume<FloatImageType, FloatImageType>::New();
-	comp->SetInput(reader->GetOutput());
-	comp->SetThreshold(threshold);
-	comp->SetVariance(variance);
-	comp->Update();
+// Parse the optional flags from argv[first] on. Returns false on an unknown option.
+bool ParseOptions(int argc, char **argv, int first, SegmentOptions& options) {
+    for (int i = first; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--threshold" && i + 1 < argc) {
+            options.threshold = std::stoi(argv[++i]);
+        }
+        else if (option == "--variance" && i + 1 < argc) {
+            options.variance = std::stod(argv[++i]);
+        }
+        else if (option == "--radius" && i + 1 < argc) {
+            options.radius = std::stoi(argv[++i]);
+        }
+        else if (option == "--fast-morphology") {
+            options.useFastMorphology = true;
+        }
+        else if (option == "--recursive-gaussian") {
+            options.useRecursiveGaussian = true;
+        }
+        else if (option == "--jobs" && i + 1 < argc) {
+            options.jobs = std::max(1, std::stoi(argv[++i]));
+        }
+        else {
+            std::cout << "Unknown option " << option << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
 
-    /*
-    // Invert mask
-    itk::InvertIntensityImageFilter<FloatImageType, FloatImageType>::Pointer invertFilter = itk::InvertIntensityImageFilter<FloatImageType, FloatImageType>::New();
-    invertFilter->SetMaximum(255);
-    invertFilter->SetInput(comp->GetOutput());
-    //invertFilter->Update();
+std::vector<std::string> GenerateFileNames(const std::string& format, int start, int end) {
+    itk::NumericSeriesFileNames::Pointer nameGenerator = itk::NumericSeriesFileNames::New();
+    nameGenerator->SetSeriesFormat(format);
+    nameGenerator->SetStartIndex(start);
+    nameGenerator->SetEndIndex(end);
+    nameGenerator->SetIncrementIndex(1);
+    return nameGenerator->GetFileNames();
+}
 
-    // Fill holes in mask -- full body mask
-    itk::BinaryFillholeImageFilter<FloatImageType>::Pointer fillHoles = itk::BinaryFillholeImageFilter<FloatImageType>::New();
-    fillHoles->SetInput(invertFilter->GetOutput());
-    fillHoles->SetForegroundValue( 255 );
-    fillHoles->Update();
+// Segments the lungs in a numbered series of 2D slices and writes one mask
+// per slice. Slices are independent, so each worker reads, segments and
+// writes whole slices with single-threaded filters. Needs no display.
+int main(int argc, char *argv[]) {
+    if (argc < 5) {
+        PrintUsage();
+        return 1;
+    }
+    SegmentOptions options;
+    if (!ParseOptions(argc, argv, 5, options)) {
+        PrintUsage();
+        return 1;
+    }
+    const std::vector<std::string> inputFiles = GenerateFileNames(argv[1], atoi(argv[2]), atoi(argv[3]));
+    const std::vector<std::string> outputFiles = GenerateFileNames(argv[4], atoi(argv[2]), atoi(argv[3]));
 
-    // Invert mask back
-    itk::InvertIntensityImageFilter<FloatImageType, FloatImageType>::Pointer invertFilter2 = itk::InvertIntensityImageFilter<FloatImageType, FloatImageType>::New();
-    invertFilter2->SetMaximum(255);
-    invertFilter2->SetInput(fillHoles->GetOutput());
-    //invertFilter2->Update();
-    */
-	
-    // Mask for the body region
-    itk::MaskImageFilter<FloatImageType, FloatImageType, FloatImageType>::Pointer mask = itk::MaskImageFilter<FloatImageType, FloatImageType, FloatImageType>::New();
-    mask->SetMaskImage(comp->GetOutput());
-    mask->SetInput(reader->GetOutput());
-    mask->SetMaskingValue(0);
-    mask->Update();
-    
-    /*
-    //
-    itk::InvertIntensityImageFilter<MaskType, MaskType>::Pointer invertFilter3 = itk::InvertIntensityImageFilter<MaskType, MaskType>::New();
-    invertFilter3->SetMaximum(255);
-    invertFilter3->SetInput(comp->GetOutput());
-    //invertFilter3->Update();
+    std::atomic<size_t> nextSlice(0);
+    std::atomic<size_t> failures(0);
+    std::mutex logMutex;
+    auto worker = [&]() {
+        typedef itk::ImageFileReader<FloatImageType> ReaderType;
+        typedef itk::ImageFileWriter<MaskType> WriterType;
+        for (size_t slice = nextSlice++; slice < inputFiles.size(); slice = nextSlice++) {
+            try {
+                ReaderType::Pointer reader = ReaderType::New();
+                reader->SetFileName(inputFiles[slice]);
 
-    // Invert and mask for lung regions
-    itk::MaskImageFilter<FloatImageType, MaskType, FloatImageType>::Pointer lungMask = itk::MaskImageFilter<FloatImageType, MaskType, FloatImageType>::New();
-    lungMask->SetMaskImage(invertFilter3->GetOutput());
-    lungMask->SetInput(mask->GetOutput());
-    lungMask->SetMaskingValue(255);
-    lungMask->Update();
-    */
+                SegmentFilterType::Pointer segment = SegmentFilterType::New();
+                segment->SetInput(reader->GetOutput());
+                segment->SetThreshold(options.threshold);
+                segment->SetVariance(options.variance);
+                if (options.radius > 0) {
+                    segment->SetRadius(options.radius);
+                }
+                segment->SetUseFastMorphology(options.useFastMorphology);
+                segment->SetUseRecursiveGaussian(options.useRecursiveGaussian);
+                segment->SetNumberOfThreads(1);
 
-	// Display
-	QuickView viewer;
-    viewer.AddImage<FloatImageType>(reader->GetOutput());
-	viewer.AddImage<FloatImageType>(mask->GetOutput());
-    /*
-	viewer.AddImage<MaskType>(comp->GetOutput());
-	viewer.AddImage<MaskType>(invertFilter->GetOutput());
-	viewer.AddImage<MaskType>(fillHoles->GetOutput());
-	viewer.AddImage<MaskType>(invertFilter2->GetOutput());
-	viewer.AddImage<FloatImageType>(mask->GetOutput());
-	viewer.AddImage<MaskType>(invertFilter3->GetOutput());
-	viewer.AddImage<FloatImageType>(lungMask->GetOutput());
-    */
-	viewer.Visualize();
-	
-	return EXIT_SUCCESS;
-	
+                WriterType::Pointer writer = WriterType::New();
+                writer->SetFileName(outputFiles[slice]);
+                writer->SetInput(segment->GetOutput());
+                writer->Update();
+            }
+            catch (itk::ExceptionObject &e) {
+                failures++;
+                std::lock_guard<std::mutex> guard(logMutex);
+                std::cout << inputFiles[slice] << ": " << e.GetDescription() << std::endl;
+            }
+            catch (std::exception &e) {
+                failures++;
+                std::lock_guard<std::mutex> guard(logMutex);
+                std::cout << inputFiles[slice] << ": " << e.what() << std::endl;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    const size_t workerCount = std::min<size_t>(options.jobs, inputFiles.size());
+    for (size_t i = 0; i < workerCount; i++) {
+        workers.push_back(std::thread(worker));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
 
+    std::cout << "Segmented " << inputFiles.size() - failures << " of " << inputFiles.size() << " slices" << std::endl;
+    return failures > 0 ? 1 : 0;
 }
@@ -0,0 +1,418 @@
+#include "SparseChangeMap.h"
+#include "AtomicFile.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <thread>
+#include <itkByteSwapper.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionIterator.h>
+#include "itk_zlib.h"
+
+#define SPARSE_CHANGE_MAP_MAGIC "LCDMAP"
+#define SPARSE_CHANGE_MAP_VERSION 2
+
+namespace {
+
+// Fixed-width little-endian fields, so the file does not depend on the
+// host's byte order or struct padding
+void AppendLittleEndian(std::vector<unsigned char> &bytes, unsigned long long value, unsigned int width) {
+    for (unsigned int i = 0; i < width; i++) {
+        bytes.push_back(static_cast<unsigned char>(value >> (8 * i)));
+    }
+}
+
+unsigned long long LittleEndianValue(const unsigned char *bytes, unsigned int width) {
+    unsigned long long value = 0;
+    for (unsigned int i = 0; i < width; i++) {
+        value |= static_cast<unsigned long long>(bytes[i]) << (8 * i);
+    }
+    return value;
+}
+
+void AppendDouble(std::vector<unsigned char> &bytes, double value) {
+    unsigned long long bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    AppendLittleEndian(bytes, bits, 8);
+}
+
+double DoubleValue(const unsigned char *bytes) {
+    const unsigned long long bits = LittleEndianValue(bytes, 8);
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+}
+
+template <typename TImage>
+typename SparseChangeMap<TImage>::PixelTypeCode SparseChangeMap<TImage>::GetPixelTypeCode() {
+    if (!std::numeric_limits<PixelType>::is_integer) {
+        return sizeof(PixelType) == 4 ? Float32 : sizeof(PixelType) == 8 ? Float64 : UnknownPixelType;
+    }
+    const bool isSigned = std::numeric_limits<PixelType>::is_signed;
+    switch (sizeof(PixelType)) {
+    case 1:
+        return isSigned ? Int8 : UInt8;
+    case 2:
+        return isSigned ? Int16 : UInt16;
+    case 4:
+        return isSigned ? Int32 : UInt32;
+    default:
+        return UnknownPixelType;
+    }
+}
+
+template <typename TImage>
+void SparseChangeMap<TImage>::EncodeHeader(const Header &header, std::vector<unsigned char> &bytes) {
+    bytes.insert(bytes.end(), header.magic, header.magic + sizeof(header.magic));
+    AppendLittleEndian(bytes, header.version, 4);
+    AppendLittleEndian(bytes, header.pixelType, 4);
+    AppendLittleEndian(bytes, header.dimension, 4);
+    for (unsigned int d = 0; d < 3; d++) {
+        AppendLittleEndian(bytes, header.size[d], 8);
+    }
+    for (unsigned int d = 0; d < 3; d++) {
+        AppendDouble(bytes, header.spacing[d]);
+    }
+    for (unsigned int d = 0; d < 3; d++) {
+        AppendDouble(bytes, header.origin[d]);
+    }
+    for (unsigned int i = 0; i < 9; i++) {
+        AppendDouble(bytes, header.direction[i]);
+    }
+    for (unsigned int d = 0; d < 3; d++) {
+        AppendLittleEndian(bytes, header.blockSize[d], 8);
+    }
+    AppendLittleEndian(bytes, header.storedBlocks, 8);
+}
+
+template <typename TImage>
+bool SparseChangeMap<TImage>::DecodeHeader(std::istream &in, Header &header) {
+    unsigned char bytes[HeaderBytes];
+    if (!in.read(reinterpret_cast<char *>(bytes), HeaderBytes)) {
+        return false;
+    }
+    const unsigned char *field = bytes;
+    std::memcpy(header.magic, field, sizeof(header.magic));
+    field += sizeof(header.magic);
+    header.version = static_cast<unsigned int>(LittleEndianValue(field, 4));
+    header.pixelType = static_cast<unsigned int>(LittleEndianValue(field + 4, 4));
+    header.dimension = static_cast<unsigned int>(LittleEndianValue(field + 8, 4));
+    field += 12;
+    for (unsigned int d = 0; d < 3; d++, field += 8) {
+        header.size[d] = LittleEndianValue(field, 8);
+    }
+    for (unsigned int d = 0; d < 3; d++, field += 8) {
+        header.spacing[d] = DoubleValue(field);
+    }
+    for (unsigned int d = 0; d < 3; d++, field += 8) {
+        header.origin[d] = DoubleValue(field);
+    }
+    for (unsigned int i = 0; i < 9; i++, field += 8) {
+        header.direction[i] = DoubleValue(field);
+    }
+    for (unsigned int d = 0; d < 3; d++, field += 8) {
+        header.blockSize[d] = LittleEndianValue(field, 8);
+    }
+    header.storedBlocks = LittleEndianValue(field, 8);
+    return std::strncmp(header.magic, SPARSE_CHANGE_MAP_MAGIC, sizeof(header.magic)) == 0;
+}
+
+template <typename TImage>
+typename SparseChangeMap<TImage>::SizeType SparseChangeMap<TImage>::DefaultBlockSize() {
+    SizeType blockSize;
+    blockSize[0] = 64;
+    blockSize[1] = 64;
+    blockSize[2] = 8;
+    return blockSize;
+}
+
+template <typename TImage>
+typename TImage::RegionType SparseChangeMap<TImage>::BlockRegion(const ImageType *image, const SizeType &blockSize, unsigned long long block) {
+    const typename ImageType::RegionType &largest = image->GetLargestPossibleRegion();
+    typename ImageType::RegionType region;
+    for (unsigned int d = 0; d < 3; d++) {
+        const unsigned long long blocks = (largest.GetSize()[d] + blockSize[d] - 1) / blockSize[d];
+        const unsigned long long position = block % blocks;
+        block /= blocks;
+        region.SetIndex(d, largest.GetIndex()[d] + position * blockSize[d]);
+        region.SetSize(d, std::min<unsigned long long>(blockSize[d], largest.GetSize()[d] - position * blockSize[d]));
+    }
+    return region;
+}
+
+template <typename TImage>
+typename SparseChangeMap<TImage>::Statistics
+SparseChangeMap<TImage>::Write(const ImageType *image, const std::string &fileName, unsigned int threads, const SizeType &requestedBlockSize) {
+    if (GetPixelTypeCode() == UnknownPixelType) {
+        itkGenericExceptionMacro(<< "Change maps cannot hold this pixel type, writing " << fileName);
+    }
+    const typename ImageType::RegionType &largest = image->GetLargestPossibleRegion();
+
+    // Blocks never extend past the image, so Read accepts every header written here
+    SizeType blockSize;
+    for (unsigned int d = 0; d < 3; d++) {
+        if (requestedBlockSize[d] == 0 || largest.GetSize()[d] == 0) {
+            itkGenericExceptionMacro(<< "Empty image or block size writing " << fileName);
+        }
+        blockSize[d] = std::min(requestedBlockSize[d], largest.GetSize()[d]);
+    }
+    unsigned long long totalBlocks = 1;
+    for (unsigned int d = 0; d < 3; d++) {
+        totalBlocks *= (largest.GetSize()[d] + blockSize[d] - 1) / blockSize[d];
+    }
+
+    // Compress the non-zero blocks on worker threads; each block lands in its own buffer
+    std::vector<std::vector<unsigned char> > compressed(totalBlocks);
+    std::atomic<unsigned long long> nextBlock(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+        std::vector<PixelType> pixels;
+        for (unsigned long long block = nextBlock++; block < totalBlocks && !failed; block = nextBlock++) {
+            const typename ImageType::RegionType region = BlockRegion(image, blockSize, block);
+            pixels.resize(region.GetNumberOfPixels());
+            bool empty = true;
+            itk::ImageRegionConstIterator<ImageType> it(image, region);
+            for (size_t i = 0; !it.IsAtEnd(); ++it, i++) {
+                pixels[i] = it.Get();
+                empty = empty && pixels[i] == PixelType(0);
+            }
+            if (empty) {
+                continue;
+            }
+            itk::ByteSwapper<PixelType>::SwapRangeFromSystemToLittleEndian(&pixels[0], pixels.size());
+
+            const uLong sourceBytes = static_cast<uLong>(pixels.size() * sizeof(PixelType));
+            uLongf bytes = compressBound(sourceBytes);
+            compressed[block].resize(bytes);
+            if (compress2(&compressed[block][0], &bytes, reinterpret_cast<const Bytef *>(&pixels[0]), sourceBytes, Z_BEST_SPEED) != Z_OK) {
+                failed = true;
+            }
+            compressed[block].resize(bytes);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < std::max(1u, threads); i++) {
+        workers.push_back(std::thread(worker));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    if (failed) {
+        itkGenericExceptionMacro(<< "Could not compress change map for " << fileName);
+    }
+
+    // Header, then the block table, then the payloads in block order
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::strncpy(header.magic, SPARSE_CHANGE_MAP_MAGIC, sizeof(header.magic));
+    header.version = SPARSE_CHANGE_MAP_VERSION;
+    header.pixelType = GetPixelTypeCode();
+    header.dimension = 3;
+    for (unsigned int d = 0; d < 3; d++) {
+        header.size[d] = largest.GetSize()[d];
+        header.spacing[d] = image->GetSpacing()[d];
+        header.origin[d] = image->GetOrigin()[d];
+        header.blockSize[d] = blockSize[d];
+        for (unsigned int e = 0; e < 3; e++) {
+            header.direction[d * 3 + e] = image->GetDirection()[d][e];
+        }
+    }
+    std::vector<BlockEntry> table;
+    unsigned long long offset = 0;
+    for (unsigned long long block = 0; block < totalBlocks; block++) {
+        if (compressed[block].empty()) {
+            continue;
+        }
+        BlockEntry entry;
+        entry.block = block;
+        entry.offset = offset;
+        entry.compressedBytes = compressed[block].size();
+        offset += entry.compressedBytes;
+        table.push_back(entry);
+    }
+    header.storedBlocks = table.size();
+    std::vector<unsigned char> prefix;
+    EncodeHeader(header, prefix);
+    for (size_t i = 0; i < table.size(); i++) {
+        AppendLittleEndian(prefix, table[i].block, 8);
+        AppendLittleEndian(prefix, table[i].offset, 8);
+        AppendLittleEndian(prefix, table[i].compressedBytes, 8);
+    }
+
+    // Write beside the destination and rename, so a reader never sees a partial map
+    const std::string temporary = AtomicFile::TemporaryName(fileName);
+    {
+        std::ofstream out(temporary.c_str(), std::ios::binary);
+        if (!out) {
+            itkGenericExceptionMacro(<< "Could not open " << temporary << " for writing");
+        }
+        out.write(reinterpret_cast<const char *>(&prefix[0]), prefix.size());
+        for (size_t i = 0; i < table.size(); i++) {
+            out.write(reinterpret_cast<const char *>(&compressed[table[i].block][0]), table[i].compressedBytes);
+        }
+        out.close();
+        if (!out) {
+            std::remove(temporary.c_str());
+            itkGenericExceptionMacro(<< "Could not write " << fileName);
+        }
+    }
+    if (!AtomicFile::Commit(temporary, fileName)) {
+        itkGenericExceptionMacro(<< "Could not replace " << fileName);
+    }
+
+    Statistics statistics;
+    statistics.totalBlocks = totalBlocks;
+    statistics.storedBlocks = table.size();
+    statistics.compressedBytes = offset;
+    statistics.denseBytes = largest.GetNumberOfPixels() * sizeof(PixelType);
+    return statistics;
+}
+
+template <typename TImage>
+typename SparseChangeMap<TImage>::PixelTypeCode SparseChangeMap<TImage>::ReadPixelType(const std::string &fileName) {
+    std::ifstream in(fileName.c_str(), std::ios::binary);
+    Header header;
+    if (!in || !DecodeHeader(in, header) || header.version != SPARSE_CHANGE_MAP_VERSION || header.pixelType > Float64) {
+        return UnknownPixelType;
+    }
+    return static_cast<PixelTypeCode>(header.pixelType);
+}
+
+template <typename TImage>
+typename SparseChangeMap<TImage>::ImagePointer
+SparseChangeMap<TImage>::Read(const std::string &fileName, unsigned int threads, Statistics *statistics) {
+    std::ifstream in(fileName.c_str(), std::ios::binary | std::ios::ate);
+    if (!in) {
+        itkGenericExceptionMacro(<< "Could not read " << fileName);
+    }
+    const unsigned long long fileBytes = static_cast<unsigned long long>(in.tellg());
+    in.seekg(0);
+    Header header;
+    if (!DecodeHeader(in, header)) {
+        itkGenericExceptionMacro(<< fileName << " is not a change map");
+    }
+    if (header.version != SPARSE_CHANGE_MAP_VERSION) {
+        itkGenericExceptionMacro(<< fileName << " is change map format version " << header.version << "; this build reads version " << SPARSE_CHANGE_MAP_VERSION);
+    }
+    if (header.pixelType != static_cast<unsigned int>(GetPixelTypeCode()) || header.dimension != 3) {
+        itkGenericExceptionMacro(<< fileName << " is not a change map with this pixel type");
+    }
+
+    // Check the geometry and block counts before allocating anything they size
+    const unsigned long long maximumPixels = std::numeric_limits<size_t>::max() / sizeof(PixelType);
+    unsigned long long pixelCount = 1;
+    unsigned long long totalBlocks = 1;
+    for (unsigned int d = 0; d < 3; d++) {
+        if (header.size[d] == 0 || header.size[d] > maximumPixels / pixelCount
+            || header.blockSize[d] == 0 || header.blockSize[d] > header.size[d] || !(header.spacing[d] > 0.0)) {
+            itkGenericExceptionMacro(<< "Corrupt geometry in " << fileName);
+        }
+        pixelCount *= header.size[d];
+        totalBlocks *= (header.size[d] + header.blockSize[d] - 1) / header.blockSize[d];
+    }
+    if (header.storedBlocks > totalBlocks || header.storedBlocks > (fileBytes - HeaderBytes) / BlockEntryBytes) {
+        itkGenericExceptionMacro(<< "Corrupt block count in " << fileName);
+    }
+    const unsigned long long tableBytes = header.storedBlocks * BlockEntryBytes;
+
+    // Block table: blocks in order, payloads back to back, ending at the end of the file
+    std::vector<unsigned char> tableData(static_cast<size_t>(tableBytes));
+    if (tableBytes && !in.read(reinterpret_cast<char *>(&tableData[0]), tableBytes)) {
+        itkGenericExceptionMacro(<< "Truncated block table in " << fileName);
+    }
+    unsigned long long blockBytes = sizeof(PixelType);
+    for (unsigned int d = 0; d < 3; d++) {
+        blockBytes *= header.blockSize[d];
+    }
+    const unsigned long long maximumCompressedBytes = compressBound(static_cast<uLong>(std::min<unsigned long long>(blockBytes, std::numeric_limits<uLong>::max())));
+    std::vector<BlockEntry> table(static_cast<size_t>(header.storedBlocks));
+    unsigned long long payloadBytes = 0;
+    for (size_t i = 0; i < table.size(); i++) {
+        const unsigned char *entry = &tableData[i * BlockEntryBytes];
+        table[i].block = LittleEndianValue(entry, 8);
+        table[i].offset = LittleEndianValue(entry + 8, 8);
+        table[i].compressedBytes = LittleEndianValue(entry + 16, 8);
+        if (table[i].block >= totalBlocks || (i > 0 && table[i].block <= table[i - 1].block)
+            || table[i].offset != payloadBytes || table[i].compressedBytes == 0 || table[i].compressedBytes > maximumCompressedBytes) {
+            itkGenericExceptionMacro(<< "Corrupt block table in " << fileName);
+        }
+        payloadBytes += table[i].compressedBytes;
+    }
+    if (HeaderBytes + tableBytes + payloadBytes != fileBytes) {
+        itkGenericExceptionMacro(<< "Block data in " << fileName << " does not match its table");
+    }
+
+    // Geometry
+    ImagePointer image = ImageType::New();
+    typename ImageType::RegionType region;
+    typename ImageType::SpacingType spacing;
+    typename ImageType::PointType origin;
+    typename ImageType::DirectionType direction;
+    SizeType blockSize;
+    for (unsigned int d = 0; d < 3; d++) {
+        region.SetSize(d, header.size[d]);
+        spacing[d] = header.spacing[d];
+        origin[d] = header.origin[d];
+        blockSize[d] = header.blockSize[d];
+        for (unsigned int e = 0; e < 3; e++) {
+            direction[d][e] = header.direction[d * 3 + e];
+        }
+    }
+
+    std::vector<unsigned char> payload(static_cast<size_t>(payloadBytes));
+    if (payloadBytes && !in.read(reinterpret_cast<char *>(&payload[0]), payloadBytes)) {
+        itkGenericExceptionMacro(<< "Truncated block data in " << fileName);
+    }
+    image->SetRegions(region);
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->SetDirection(direction);
+    image->Allocate();
+    image->FillBuffer(PixelType(0));
+
+    // Inflate blocks in parallel; blocks never overlap so workers write directly into the image
+    std::atomic<size_t> nextEntry(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+        std::vector<PixelType> pixels;
+        for (size_t i = nextEntry++; i < table.size() && !failed; i = nextEntry++) {
+            const typename ImageType::RegionType blockRegion = BlockRegion(image, blockSize, table[i].block);
+            pixels.resize(blockRegion.GetNumberOfPixels());
+            uLongf bytes = static_cast<uLongf>(pixels.size() * sizeof(PixelType));
+            if (uncompress(reinterpret_cast<Bytef *>(&pixels[0]), &bytes, &payload[table[i].offset], static_cast<uLong>(table[i].compressedBytes)) != Z_OK
+                || bytes != pixels.size() * sizeof(PixelType)) {
+                failed = true;
+                break;
+            }
+            // Stored little-endian; the swap is its own inverse
+            itk::ByteSwapper<PixelType>::SwapRangeFromSystemToLittleEndian(&pixels[0], pixels.size());
+            itk::ImageRegionIterator<ImageType> it(image, blockRegion);
+            for (size_t p = 0; !it.IsAtEnd(); ++it, p++) {
+                it.Set(pixels[p]);
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < std::max(1u, threads); i++) {
+        workers.push_back(std::thread(worker));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    if (failed) {
+        itkGenericExceptionMacro(<< "Corrupt block data in " << fileName);
+    }
+
+    if (statistics) {
+        statistics->totalBlocks = totalBlocks;
+        statistics->storedBlocks = table.size();
+        statistics->compressedBytes = payloadBytes;
+        statistics->denseBytes = region.GetNumberOfPixels() * sizeof(PixelType);
+    }
+    return image;
+}
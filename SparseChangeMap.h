@@ -0,0 +1,80 @@
+#pragma once
+#include <istream>
+#include <string>
+#include <vector>
+#include <itkImage.h>
+
+// Block-sparse, compressed storage for change maps. The volume is split into
+// fixed-size blocks; blocks that are entirely zero (everything outside the
+// lung masks) are not stored and every other block is deflated on its own,
+// in parallel. The file keeps the full geometry so Read restores an image
+// identical to the one written. Every field and pixel is stored little-endian
+// whatever the host, and the header carries a format version and the pixel
+// type, so files move between machines and are rejected rather than misread.
+template <typename TImage>
+class SparseChangeMap
+{
+public:
+    typedef TImage ImageType;
+    typedef typename ImageType::Pointer ImagePointer;
+    typedef typename ImageType::PixelType PixelType;
+    typedef typename ImageType::SizeType SizeType;
+
+    // Pixel types a change map can hold, as stored in the header
+    enum PixelTypeCode { UnknownPixelType = 0, UInt8 = 1, Int8 = 2, UInt16 = 3, Int16 = 4, UInt32 = 5, Int32 = 6, Float32 = 7, Float64 = 8 };
+
+    struct Statistics {
+        unsigned long long totalBlocks;
+        unsigned long long storedBlocks;
+        unsigned long long compressedBytes;
+        unsigned long long denseBytes;
+    };
+
+    // Throws itk::ExceptionObject on I/O errors and on files that are not
+    // change maps of this pixel type. Write replaces the file only once it is
+    // complete; block sizes larger than the image are clamped to it.
+    static Statistics Write(const ImageType *image, const std::string &fileName, unsigned int threads, const SizeType &blockSize = DefaultBlockSize());
+    static ImagePointer Read(const std::string &fileName, unsigned int threads, Statistics *statistics = ITK_NULLPTR);
+
+    // Pixel type stored in a change map, or UnknownPixelType if the file is
+    // not one this version reads; lets readers pick the image type before
+    // calling Read
+    static PixelTypeCode ReadPixelType(const std::string &fileName);
+
+    // Code for ImageType's pixel type
+    static PixelTypeCode GetPixelTypeCode();
+
+    // 64x64 voxels by 8 slices: small enough that the space around the lungs
+    // drops out, large enough to deflate well
+    static SizeType DefaultBlockSize();
+
+protected:
+    struct Header {
+        char magic[8];
+        unsigned int version;
+        unsigned int pixelType;
+        unsigned int dimension;
+        unsigned long long size[3];
+        double spacing[3];
+        double origin[3];
+        double direction[9];
+        unsigned long long blockSize[3];
+        unsigned long long storedBlocks;
+    };
+
+    // One entry per stored block, in block order, after the header
+    struct BlockEntry {
+        unsigned long long block;
+        unsigned long long offset;
+        unsigned long long compressedBytes;
+    };
+
+    // Encoded sizes on disk, independent of struct layout
+    static const unsigned int HeaderBytes = 8 + 3 * 4 + 22 * 8;
+    static const unsigned int BlockEntryBytes = 3 * 8;
+
+    static void EncodeHeader(const Header &header, std::vector<unsigned char> &bytes);
+    static bool DecodeHeader(std::istream &in, Header &header);
+
+    static typename ImageType::RegionType BlockRegion(const ImageType *image, const SizeType &blockSize, unsigned long long block);
+};
@@ -0,0 +1,278 @@
+#include "StageTrace.h"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#include <cstdio>
+#endif
+
+StageTrace::Scope::Scope(const std::string &name)
+{
+    m_Enabled = StageTrace::Instance().IsEnabled();
+    m_Bytes = 0;
+    if (m_Enabled) {
+        m_Name = name;
+        m_Start = Clock::now();
+    }
+}
+
+StageTrace::Scope::~Scope()
+{
+    if (!m_Enabled) {
+        return;
+    }
+    StageTrace &trace = StageTrace::Instance();
+    Event event;
+    event.name = m_Name;
+    event.phase = 'X';
+    event.start = trace.Microseconds(m_Start);
+    event.duration = trace.Microseconds(Clock::now()) - event.start;
+    event.value = 0.0;
+    event.bytes = m_Bytes;
+    trace.Record(event);
+
+    // Sample memory whenever a stage ends; memory is per process, so unlabelled
+    trace.RecordCounter("resident MB", CurrentResidentBytes() / (1024.0 * 1024.0));
+}
+
+void StageTrace::Scope::SetBytes(size_t bytes) {
+    m_Bytes = bytes;
+}
+
+namespace {
+
+thread_local std::string currentLabel;
+
+}
+
+StageTrace::Label::Label(const std::string &name)
+{
+    m_Previous = currentLabel;
+    currentLabel = m_Previous.empty() ? name : m_Previous + " / " + name;
+}
+
+StageTrace::Label::~Label()
+{
+    currentLabel = m_Previous;
+}
+
+const std::string &StageTrace::Label::Current() {
+    return currentLabel;
+}
+
+StageTrace::StageTrace()
+{
+    m_Origin = Clock::now();
+    m_Enabled = false;
+}
+
+StageTrace &StageTrace::Instance() {
+    static StageTrace trace;
+    return trace;
+}
+
+void StageTrace::SetEnabled(bool enabled) {
+    m_Enabled = enabled;
+}
+
+bool StageTrace::IsEnabled() const {
+    return m_Enabled;
+}
+
+void StageTrace::Counter(const std::string &name, double value) {
+    if (!m_Enabled) {
+        return;
+    }
+    const std::string &label = Label::Current();
+    RecordCounter(label.empty() ? name : label + ": " + name, value);
+}
+
+void StageTrace::RecordCounter(const std::string &name, double value) {
+    if (!m_Enabled) {
+        return;
+    }
+    Event event;
+    event.name = name;
+    event.phase = 'C';
+    event.start = Microseconds(Clock::now());
+    event.duration = 0.0;
+    event.value = value;
+    event.bytes = 0;
+    Record(event);
+}
+
+void StageTrace::Buffer(const std::string &name, size_t bytes) {
+    if (!m_Enabled) {
+        return;
+    }
+    Event event;
+    event.name = name;
+    event.phase = 'B';
+    event.start = Microseconds(Clock::now());
+    event.duration = 0.0;
+    event.value = bytes / (1024.0 * 1024.0);
+    event.bytes = bytes;
+    Record(event);
+}
+
+void StageTrace::Record(const Event &event) {
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    m_Events.push_back(event);
+    m_Events.back().thread = ThreadNumber();
+}
+
+double StageTrace::Microseconds(Clock::time_point time) const {
+    return std::chrono::duration<double, std::micro>(time - m_Origin).count();
+}
+
+// Small stable numbers read better in trace viewers than native thread ids.
+// Called with the mutex held.
+unsigned int StageTrace::ThreadNumber() {
+    const std::thread::id id = std::this_thread::get_id();
+    std::map<std::thread::id, unsigned int>::iterator found = m_Threads.find(id);
+    if (found != m_Threads.end()) {
+        return found->second;
+    }
+    const unsigned int number = static_cast<unsigned int>(m_Threads.size()) + 1;
+    m_Threads[id] = number;
+    return number;
+}
+
+namespace {
+
+std::string EscapeJson(const std::string &text) {
+    std::string escaped;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '"' || text[i] == '\\') {
+            escaped += '\\';
+        }
+        escaped += text[i];
+    }
+    return escaped;
+}
+
+}
+
+bool StageTrace::WriteChromeTrace(const std::string &fileName) const {
+    std::ofstream out(fileName.c_str());
+    if (!out) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    for (size_t i = 0; i < m_Events.size(); i++) {
+        const Event &event = m_Events[i];
+        const std::string name = EscapeJson(event.name);
+        out << "  {\"pid\": 1, \"tid\": " << event.thread << ", \"ts\": " << event.start << ", ";
+        if (event.phase == 'X') {
+            out << "\"ph\": \"X\", \"cat\": \"stage\", \"name\": \"" << name << "\", \"dur\": " << event.duration
+                << ", \"args\": {\"bytes\": " << event.bytes << "}}";
+        }
+        else if (event.phase == 'B') {
+            out << "\"ph\": \"C\", \"name\": \"buffers MB\", \"args\": {\"" << name << "\": " << event.value << "}}";
+        }
+        else {
+            out << "\"ph\": \"C\", \"name\": \"" << name << "\", \"args\": {\"value\": " << event.value << "}}";
+        }
+        out << (i + 1 < m_Events.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+    return static_cast<bool>(out);
+}
+
+void StageTrace::WriteSummary(std::ostream &out) const {
+    struct Row {
+        unsigned int calls;
+        double total;
+        double longest;
+        size_t bytes;
+    };
+
+    // Stages in the order they first finished
+    std::vector<std::string> order;
+    std::map<std::string, Row> rows;
+    std::map<std::string, unsigned int> counters;
+    {
+        std::lock_guard<std::mutex> guard(m_Mutex);
+        for (size_t i = 0; i < m_Events.size(); i++) {
+            const Event &event = m_Events[i];
+            if (event.phase == 'C') {
+                counters[event.name]++;
+                continue;
+            }
+            if (event.phase != 'X') {
+                continue;
+            }
+            if (rows.find(event.name) == rows.end()) {
+                const Row empty = { 0, 0.0, 0.0, 0 };
+                rows[event.name] = empty;
+                order.push_back(event.name);
+            }
+            Row &row = rows[event.name];
+            row.calls++;
+            row.total += event.duration / 1e6;
+            row.longest = std::max(row.longest, event.duration / 1e6);
+            row.bytes = std::max(row.bytes, event.bytes);
+        }
+    }
+
+    out << std::left << std::setw(40) << "Stage" << std::right << std::setw(8) << "Calls" << std::setw(12) << "Total s"
+        << std::setw(12) << "Longest s" << std::setw(12) << "Output MB" << std::endl;
+    out << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < order.size(); i++) {
+        const Row &row = rows[order[i]];
+        out << std::left << std::setw(40) << order[i] << std::right << std::setw(8) << row.calls << std::setw(12) << row.total
+            << std::setw(12) << row.longest << std::setw(12) << row.bytes / (1024.0 * 1024.0) << std::endl;
+    }
+    for (std::map<std::string, unsigned int>::const_iterator it = counters.begin(); it != counters.end(); ++it) {
+        out << it->first << ": " << it->second << " samples" << std::endl;
+    }
+    out << "Peak resident memory: " << PeakResidentBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+}
+
+size_t StageTrace::CurrentResidentBytes() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.WorkingSetSize;
+    }
+    return 0;
+#else
+    // Second field of statm is the resident page count
+    FILE *statm = std::fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return 0;
+    }
+    long pages = 0;
+    long resident = 0;
+    const int fields = std::fscanf(statm, "%ld %ld", &pages, &resident);
+    std::fclose(statm);
+    return fields == 2 ? static_cast<size_t>(resident) * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+#endif
+}
+
+size_t StageTrace::PeakResidentBytes() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__)
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Records how long pipeline stages take, how much memory the process holds
+// and per-iteration optimizer metrics. Tracing is off until enabled, in which
+// case the scopes and counters cost only a flag check. The trace can be
+// written as Chrome trace JSON (chrome://tracing, Perfetto) or summarized as
+// a table of stage times.
+class StageTrace
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Times the enclosing block as one stage on the calling thread
+    class Scope
+    {
+    public:
+        Scope(const std::string &name);
+        ~Scope();
+
+        // Size of the stage's output, reported with the stage
+        void SetBytes(size_t bytes);
+
+    private:
+        std::string m_Name;
+        Clock::time_point m_Start;
+        size_t m_Bytes;
+        bool m_Enabled;
+    };
+
+    // Names what the calling thread is working on, e.g. a batch pair and its
+    // stage, until the label goes out of scope. Labels nest, and counters
+    // recorded under one are prefixed with it so concurrent pairs and stages
+    // keep separate series.
+    class Label
+    {
+    public:
+        Label(const std::string &name);
+        ~Label();
+
+        // The calling thread's label, empty outside any
+        static const std::string &Current();
+
+    private:
+        std::string m_Previous;
+    };
+
+    // The process-wide trace
+    static StageTrace &Instance();
+
+    void SetEnabled(bool enabled);
+    bool IsEnabled() const;
+
+    // Record a named value, e.g. an optimizer metric per iteration, under
+    // the calling thread's label
+    void Counter(const std::string &name, double value);
+
+    // Record the size of a buffer that a stage has produced
+    void Buffer(const std::string &name, size_t bytes);
+
+    bool WriteChromeTrace(const std::string &fileName) const;
+    void WriteSummary(std::ostream &out) const;
+
+    // Resident memory of the process now and at its peak, in bytes; 0 if unknown
+    static size_t CurrentResidentBytes();
+    static size_t PeakResidentBytes();
+
+private:
+    struct Event {
+        std::string name;
+        char phase;
+        double start;
+        double duration;
+        unsigned int thread;
+        double value;
+        size_t bytes;
+    };
+
+    StageTrace();
+    void Record(const Event &event);
+    void RecordCounter(const std::string &name, double value);
+    double Microseconds(Clock::time_point time) const;
+    unsigned int ThreadNumber();
+
+    mutable std::mutex m_Mutex;
+    std::vector<Event> m_Events;
+    std::map<std::thread::id, unsigned int> m_Threads;
+    Clock::time_point m_Origin;
+    std::atomic<bool> m_Enabled;
+
+    friend class Scope;
+};
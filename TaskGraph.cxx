@@ -0,0 +1,112 @@
+#include "TaskGraph.h"
+#include "StageTrace.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+TaskGraph::TaskGraph(unsigned int threadBudget)
+{
+    m_ThreadBudget = std::max(1u, threadBudget);
+}
+
+TaskGraph::~TaskGraph()
+{
+    //
+}
+
+TaskGraph::TaskId TaskGraph::AddTask(const std::string &name, const TaskFunction &function, const std::vector<TaskId> &dependencies) {
+    Task task;
+    task.name = name;
+    task.function = function;
+    task.remainingDependencies = dependencies.size();
+
+    const TaskId id = m_Tasks.size();
+    for (size_t i = 0; i < dependencies.size(); i++) {
+        if (dependencies[i] >= id) {
+            throw std::invalid_argument("Task " + name + " depends on a task that has not been added");
+        }
+        m_Tasks[dependencies[i]].dependents.push_back(id);
+    }
+    m_Tasks.push_back(task);
+    return id;
+}
+
+void TaskGraph::Run() {
+    std::mutex lock;
+    std::condition_variable finished;
+    std::deque<TaskId> ready;
+    std::vector<std::thread> threads;
+    std::exception_ptr failure;
+    unsigned int threadsInUse = 0;
+    size_t running = 0;
+    size_t completed = 0;
+
+    for (TaskId id = 0; id < m_Tasks.size(); id++) {
+        if (m_Tasks[id].remainingDependencies == 0) {
+            ready.push_back(id);
+        }
+    }
+
+    // Tasks run under the caller's trace label, e.g. its batch pair
+    const std::string label = StageTrace::Label::Current();
+
+    std::unique_lock<std::mutex> guard(lock);
+    while (completed < m_Tasks.size()) {
+        // Start ready tasks while there are threads left, splitting what is free between them
+        while (!ready.empty() && threadsInUse < m_ThreadBudget && !failure) {
+            const TaskId id = ready.front();
+            ready.pop_front();
+            const unsigned int share = std::max(1u, (m_ThreadBudget - threadsInUse) / static_cast<unsigned int>(ready.size() + 1));
+            threadsInUse += share;
+            running++;
+
+            threads.push_back(std::thread([&, id, share]() {
+                std::exception_ptr error;
+                try {
+                    StageTrace::Label job(label);
+                    StageTrace::Label task(m_Tasks[id].name);
+                    StageTrace::Scope stage(m_Tasks[id].name);
+                    m_Tasks[id].function(share);
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+
+                std::lock_guard<std::mutex> done(lock);
+                threadsInUse -= share;
+                running--;
+                completed++;
+                if (error && !failure) {
+                    failure = error;
+                }
+                for (size_t i = 0; i < m_Tasks[id].dependents.size(); i++) {
+                    if (--m_Tasks[m_Tasks[id].dependents[i]].remainingDependencies == 0) {
+                        ready.push_back(m_Tasks[id].dependents[i]);
+                    }
+                }
+                finished.notify_one();
+            }));
+        }
+
+        if (running == 0 && (failure || ready.empty())) {
+            break;
+        }
+        finished.wait(guard);
+    }
+    guard.unlock();
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    if (completed < m_Tasks.size()) {
+        throw std::logic_error("Task graph has a dependency cycle");
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+
+// Runs a set of pipeline stages as soon as the stages they depend on have
+// finished, sharing a fixed thread budget between the stages that run at
+// the same time. Each stage is told how many threads it may use and is
+// timed under its name when StageTrace is enabled.
+class TaskGraph
+{
+public:
+    typedef std::function<void(unsigned int threads)> TaskFunction;
+    typedef size_t TaskId;
+
+    TaskGraph(unsigned int threadBudget);
+    ~TaskGraph();
+
+    TaskId AddTask(const std::string &name, const TaskFunction &function, const std::vector<TaskId> &dependencies = std::vector<TaskId>());
+
+    // Blocks until every task has run. If a task throws, no new tasks are
+    // started and the first exception is rethrown once running tasks finish.
+    void Run();
+
+private:
+    struct Task {
+        std::string name;
+        TaskFunction function;
+        std::vector<TaskId> dependents;
+        size_t remainingDependencies;
+    };
+
+    std::vector<Task> m_Tasks;
+    unsigned int m_ThreadBudget;
+};
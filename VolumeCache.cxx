@@ -0,0 +1,226 @@
+#include "VolumeCache.h"
+#include "AtomicFile.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <typeinfo>
+#include <itksys/SystemTools.hxx>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Pixel data starts on a page boundary so the mapped buffer is well aligned
+#define VOLUME_CACHE_MAGIC "LCDVOL1"
+#define VOLUME_CACHE_DATA_OFFSET 4096
+
+template <typename TImage>
+VolumeCache<TImage>::VolumeCache(const std::string &directory)
+{
+    m_Directory = directory;
+    itksys::SystemTools::MakeDirectory(m_Directory.c_str());
+}
+
+template <typename TImage>
+VolumeCache<TImage>::~VolumeCache()
+{
+    //
+}
+
+template <typename TImage>
+std::string VolumeCache<TImage>::MakeKey(const std::string &seriesFormat, int startIndex, int endIndex, const std::vector<std::string> &fileNames) const {
+    std::ostringstream description;
+    description << typeid(PixelType).name() << '|' << seriesFormat << '|' << startIndex << '|' << endIndex;
+    for (size_t i = 0; i < fileNames.size(); i++) {
+        description << '|' << itksys::SystemTools::FileLength(fileNames[i].c_str())
+                    << ':' << itksys::SystemTools::ModifiedTime(fileNames[i].c_str());
+    }
+
+    // 64-bit FNV-1a
+    const std::string text = description.str();
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < text.size(); i++) {
+        hash ^= static_cast<unsigned char>(text[i]);
+        hash *= 1099511628211ULL;
+    }
+
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", hash);
+    return key;
+}
+
+template <typename TImage>
+typename VolumeCache<TImage>::ImagePointer VolumeCache<TImage>::Load(const std::string &key) {
+    Mapping mapping;
+    if (!Map(PathForKey(key), mapping)) {
+        return ImagePointer();
+    }
+
+    // Validate the header before trusting the buffer
+    Header header;
+    const unsigned int dimension = ImageType::ImageDimension;
+    bool valid = mapping.length >= sizeof(Header);
+    if (valid) {
+        std::memcpy(&header, mapping.address, sizeof(Header));
+        valid = std::strncmp(header.magic, VOLUME_CACHE_MAGIC, sizeof(header.magic)) == 0
+            && header.pixelSize == sizeof(PixelType)
+            && header.dimension == dimension;
+    }
+    typename ImageType::RegionType region;
+    typename ImageType::SpacingType spacing;
+    typename ImageType::PointType origin;
+    typename ImageType::DirectionType direction;
+    if (valid) {
+        typename ImageType::SizeType size;
+        for (unsigned int d = 0; d < dimension; d++) {
+            size[d] = header.size[d];
+            spacing[d] = header.spacing[d];
+            origin[d] = header.origin[d];
+            for (unsigned int e = 0; e < dimension; e++) {
+                direction[d][e] = header.direction[d * 3 + e];
+            }
+        }
+        region.SetSize(size);
+
+        // Compare by division so corrupt sizes or offsets cannot overflow
+        valid = header.dataOffset <= mapping.length;
+        if (valid) {
+            const unsigned long long capacity = (mapping.length - header.dataOffset) / sizeof(PixelType);
+            unsigned long long pixels = 1;
+            for (unsigned int d = 0; d < dimension && valid; d++) {
+                valid = header.size[d] != 0 && header.size[d] <= capacity / pixels;
+                pixels *= header.size[d];
+            }
+        }
+    }
+    if (!valid) {
+        Unmap(mapping);
+        return ImagePointer();
+    }
+
+    // Point the image at the mapped pixels; the container owns the mapping
+    ImagePointer image = ImageType::New();
+    image->SetRegions(region);
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->SetDirection(direction);
+    PixelType *pixels = reinterpret_cast<PixelType *>(static_cast<char *>(mapping.address) + header.dataOffset);
+    typename MappedPixelContainer::Pointer container = MappedPixelContainer::New();
+    container->SetImportPointer(pixels, region.GetNumberOfPixels(), false);
+    container->SetMapping(mapping);
+    image->SetPixelContainer(container);
+    return image;
+}
+
+template <typename TImage>
+bool VolumeCache<TImage>::Store(const std::string &key, const ImageType *image) {
+    const unsigned int dimension = ImageType::ImageDimension;
+    const typename ImageType::RegionType& region = image->GetBufferedRegion();
+
+    Header header;
+    std::memset(&header, 0, sizeof(Header));
+    std::strncpy(header.magic, VOLUME_CACHE_MAGIC, sizeof(header.magic));
+    header.pixelSize = sizeof(PixelType);
+    header.dimension = dimension;
+    for (unsigned int d = 0; d < dimension; d++) {
+        header.size[d] = region.GetSize()[d];
+        header.spacing[d] = image->GetSpacing()[d];
+        header.origin[d] = image->GetOrigin()[d];
+        for (unsigned int e = 0; e < dimension; e++) {
+            header.direction[d * 3 + e] = image->GetDirection()[d][e];
+        }
+    }
+    header.dataOffset = VOLUME_CACHE_DATA_OFFSET;
+
+    // Write to a temporary file of our own and move it into place, so
+    // readers and concurrent writers of the same entry never see a partial one
+    const std::string path = PathForKey(key);
+    const std::string temporary = AtomicFile::TemporaryName(path);
+    {
+        std::ofstream file(temporary.c_str(), std::ios::binary | std::ios::trunc);
+        std::vector<char> padding(VOLUME_CACHE_DATA_OFFSET - sizeof(Header), 0);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+        file.write(&padding[0], padding.size());
+        file.write(reinterpret_cast<const char *>(image->GetBufferPointer()), region.GetNumberOfPixels() * sizeof(PixelType));
+        if (!file) {
+            file.close();
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+    return AtomicFile::Commit(temporary, path);
+}
+
+template <typename TImage>
+std::string VolumeCache<TImage>::PathForKey(const std::string &key) const {
+    return m_Directory + "/" + key + ".vol";
+}
+
+template <typename TImage>
+bool VolumeCache<TImage>::Map(const std::string &path, Mapping &mapping) {
+    // Copy-on-write mappings so in-place filters never modify the cache file
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER length;
+    HANDLE fileMapping = NULL;
+    void *address = NULL;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+        fileMapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    }
+    if (fileMapping) {
+        address = MapViewOfFile(fileMapping, FILE_MAP_COPY, 0, 0, 0);
+    }
+    if (!address) {
+        if (fileMapping) {
+            CloseHandle(fileMapping);
+        }
+        CloseHandle(file);
+        return false;
+    }
+    mapping.address = address;
+    mapping.length = static_cast<size_t>(length.QuadPart);
+    mapping.file = file;
+    mapping.mapping = fileMapping;
+#else
+    int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+    struct stat status;
+    void *address = MAP_FAILED;
+    if (fstat(file, &status) == 0 && status.st_size > 0) {
+        address = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    }
+    close(file);
+    if (address == MAP_FAILED) {
+        return false;
+    }
+    mapping.address = address;
+    mapping.length = static_cast<size_t>(status.st_size);
+#endif
+    return true;
+}
+
+template <typename TImage>
+void VolumeCache<TImage>::Unmap(Mapping &mapping) {
+    if (!mapping.address) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(mapping.address);
+    CloseHandle(static_cast<HANDLE>(mapping.mapping));
+    CloseHandle(static_cast<HANDLE>(mapping.file));
+#else
+    munmap(mapping.address, mapping.length);
+#endif
+    mapping.address = NULL;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <itkImage.h>
+#include <itkImportImageContainer.h>
+
+// On-disk cache of assembled volumes. Each entry is a single file holding a
+// header with the geometry followed by the raw pixel buffer, which Load maps
+// straight into an itk::Image without decoding or copying. Each mapping
+// belongs to the image's pixel container and is unmapped when the last
+// image using that container releases it, independently of the cache.
+template <typename TImage>
+class VolumeCache
+{
+public:
+    typedef TImage ImageType;
+    typedef typename ImageType::Pointer ImagePointer;
+    typedef typename ImageType::PixelType PixelType;
+
+    // The header stores 3D geometry only
+    static_assert(ImageType::ImageDimension == 3, "VolumeCache holds 3D images only");
+
+    VolumeCache(const std::string &directory);
+    ~VolumeCache();
+
+    // Key from the series template, index range and the size and mtime of every slice file
+    std::string MakeKey(const std::string &seriesFormat, int startIndex, int endIndex, const std::vector<std::string> &fileNames) const;
+
+    // Returns a null pointer when there is no valid entry for the key
+    ImagePointer Load(const std::string &key);
+    bool Store(const std::string &key, const ImageType *image);
+
+protected:
+    struct Header {
+        char magic[8];
+        unsigned int pixelSize;
+        unsigned int dimension;
+        unsigned long long size[3];
+        double spacing[3];
+        double origin[3];
+        double direction[9];
+        unsigned long long dataOffset;
+    };
+
+    struct Mapping {
+        void *address;
+        size_t length;
+#ifdef _WIN32
+        void *file;
+        void *mapping;
+#endif
+    };
+
+    // Pixel container over a mapped entry that unmaps it when destroyed
+    class MappedPixelContainer : public itk::ImportImageContainer<itk::SizeValueType, PixelType>
+    {
+    public:
+        typedef MappedPixelContainer Self;
+        typedef itk::ImportImageContainer<itk::SizeValueType, PixelType> Superclass;
+        typedef itk::SmartPointer<Self> Pointer;
+
+        itkNewMacro(Self);
+
+        void SetMapping(const Mapping &mapping) { m_Mapping = mapping; }
+
+    protected:
+        MappedPixelContainer() { m_Mapping.address = ITK_NULLPTR; }
+        ~MappedPixelContainer() { VolumeCache::Unmap(m_Mapping); }
+
+    private:
+        Mapping m_Mapping;
+    };
+
+    std::string PathForKey(const std::string &key) const;
+    static bool Map(const std::string &path, Mapping &mapping);
+    static void Unmap(Mapping &mapping);
+
+private:
+    std::string m_Directory;
+};